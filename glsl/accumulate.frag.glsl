@@ -5,13 +5,12 @@ uniform usampler2D accumulator;
 
 uniform bool add = true;
 
-in  vec2 pos;
 out uvec4 color;
 
 void main(void)
 {
-	vec2 size = textureSize(frame, 0);
-	ivec2 texpos = ivec2(pos * size);
+	// the viewport may be smaller than the textures when processing a band
+	ivec2 texpos = ivec2(gl_FragCoord.xy);
 
 	uvec4 old = texelFetch(accumulator, texpos, 0);
 	uvec4 new = texelFetch(frame, texpos, 0);
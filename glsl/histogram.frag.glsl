@@ -0,0 +1,9 @@
+#version 330
+
+out float count;
+
+void main(void)
+{
+	// added up by blending
+	count = 1.0;
+}
@@ -0,0 +1,24 @@
+#version 330
+
+uniform usampler2D frame;
+uniform uint samples;
+uniform ivec2 size;
+uniform int step = 1;
+
+#define	BINS		1024
+#define	BIN_SHIFT	6
+
+// One point per sampled pixel and channel (instance), placed on the bin of
+// its value in the row of its channel.
+void main(void)
+{
+	int columns = (size.x + step - 1) / step;
+	ivec2 texpos = ivec2(gl_VertexID % columns, gl_VertexID / columns) * step;
+
+	uvec4 tex = texelFetch(frame, texpos, 0);
+	uint value = min(tex[gl_InstanceID] / samples, 65535u);
+
+	float bin = float(value >> BIN_SHIFT);
+	gl_Position = vec4((bin + 0.5) / BINS * 2.0 - 1.0,
+			(float(gl_InstanceID) + 0.5) / 3.0 * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -2,15 +2,58 @@
 
 uniform usampler2D frame;
 uniform uint samples;
+uniform bool defect = false;
+uniform ivec2 bounds;
 
-in  vec2 pos;
 out uvec4 color;
 
+// Median of the up to 8 neighbours within the band, used to replace a
+// defective pixel. Every channel is selected independently.
+uvec4 neighbourhood_median(usampler2D tex, ivec2 texpos)
+{
+	uvec4 v[8];
+	int n = 0;
+
+	for(int dy = -1; dy <= 1; dy++) {
+		for(int dx = -1; dx <= 1; dx++) {
+			ivec2 p = texpos + ivec2(dx, dy);
+			if((dx == 0 && dy == 0) || any(lessThan(p, ivec2(0))) ||
+					any(greaterThanEqual(p, bounds))) {
+				continue;
+			}
+			v[n++] = texelFetch(tex, p, 0);
+		}
+	}
+
+	// lower median: the value with (n - 1) / 2 smaller values
+	uint k = uint(n - 1) / 2u;
+	uvec4 result = uvec4(0u);
+	for(int i = 0; i < n; i++) {
+		uvec4 less = uvec4(0u);
+		uvec4 less_equal = uvec4(0u);
+		for(int j = 0; j < n; j++) {
+			less += uvec4(lessThan(v[j], v[i]));
+			less_equal += uvec4(lessThanEqual(v[j], v[i]));
+		}
+		uvec4 hit = uvec4(lessThanEqual(less, uvec4(k))) *
+			uvec4(greaterThan(less_equal, uvec4(k)));
+		result = hit * v[i] + (1u - hit) * result;
+	}
+
+	return result;
+}
+
 void main(void)
 {
-	vec2 size = textureSize(frame, 0);
+	ivec2 texpos = ivec2(gl_FragCoord.xy);
+
+	uvec4 tex;
+	if(defect) {
+		tex = neighbourhood_median(frame, texpos);
+	} else {
+		tex = texelFetch(frame, texpos, 0);
+	}
 
-	uvec4 tex = texelFetch(frame, ivec2(pos * size), 0);
 	vec4 raw = clamp(tex / uvec4(samples), 0, 65535);
 
 	color = uvec4(raw);
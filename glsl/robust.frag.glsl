@@ -0,0 +1,83 @@
+#version 330
+
+uniform usampler2DArray frames;
+uniform uint count;
+uniform bool median = false;
+uniform float kappa = 3.0;
+
+out uvec4 color;
+
+#define	ITERATIONS	3
+
+void main(void)
+{
+	// the viewport may be smaller than the textures when processing a band
+	ivec2 texpos = ivec2(gl_FragCoord.xy);
+	int n = int(count);
+
+	if(median) {
+		// bisection over the 16bit value range: lo ends up as the
+		// smallest value with more than k samples less or equal to it
+		uint k = (count - 1u) / 2u;
+		uvec3 lo = uvec3(0u);
+		uvec3 hi = uvec3(65535u);
+		for(int step = 0; step < 16; step++) {
+			uvec3 mid = (lo + hi) / 2u;
+			uvec3 below = uvec3(0u);
+			for(int i = 0; i < n; i++) {
+				uvec3 v = texelFetch(frames, ivec3(texpos, i), 0).rgb;
+				below += uvec3(lessThanEqual(v, mid));
+			}
+
+			uvec3 upper = uvec3(greaterThan(below, uvec3(k)));
+			hi = upper * mid + (1u - upper) * hi;
+			lo = upper * lo + (1u - upper) * (mid + 1u);
+		}
+
+		color = uvec4(lo, 0u);
+		return;
+	}
+
+	// sigma clipping; the statistics are computed relative to the first
+	// sample to keep the float sums precise
+	vec3 base = vec3(texelFetch(frames, ivec3(texpos, 0), 0).rgb);
+	vec3 lower = vec3(0.0);
+	vec3 upper = vec3(65535.0);
+	uvec3 result = uvec3(base);
+
+	for(int iteration = 0; iteration <= ITERATIONS; iteration++) {
+		vec3 sum = vec3(0.0);
+		vec3 sum_sq = vec3(0.0);
+		vec3 used = vec3(0.0);
+		uvec3 isum = uvec3(0u);
+		uvec3 icount = uvec3(0u);
+
+		for(int i = 0; i < n; i++) {
+			uvec3 v = texelFetch(frames, ivec3(texpos, i), 0).rgb;
+			vec3 value = vec3(v);
+			uvec3 inside = uvec3(greaterThanEqual(value, lower)) *
+				uvec3(lessThanEqual(value, upper));
+			vec3 d = (value - base) * vec3(inside);
+
+			sum += d;
+			sum_sq += d * d;
+			used += vec3(inside);
+			isum += v * inside;
+			icount += inside;
+		}
+
+		// keep the previous result if everything was rejected
+		uvec3 valid = uvec3(greaterThan(icount, uvec3(0u)));
+		result = valid * (isum / max(icount, uvec3(1u))) +
+			(1u - valid) * result;
+
+		vec3 mean = sum / max(used, vec3(1.0));
+		vec3 sigma = sqrt(max(sum_sq / max(used, vec3(1.0)) - mean * mean,
+					vec3(0.0)));
+
+		lower = base + mean - kappa * sigma;
+		upper = base + mean + kappa * sigma;
+	}
+
+	color = uvec4(result, 0u);
+}
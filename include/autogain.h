@@ -0,0 +1,25 @@
+#ifndef __AUTOGAIN_H__
+#define __AUTOGAIN_H__
+
+// Picks the gain such that a percentile of the averaged frame lands on a
+// target level, either once per clip or smoothed over time.
+class AutoGain {
+	public:
+		AutoGain(bool smooth, float percentile, float target);
+
+		void		reset();
+		float		update(const float* bins, float gain);
+
+		static unsigned int percentile(const float* bins,
+					unsigned int channel, float p);
+
+	private:
+		bool		smooth;
+		float		p;
+		float		target;
+
+		bool		valid;
+		float		gain;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __AUTOTUNE_H__
+#define __AUTOTUNE_H__
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "encoder.h"
+
+// Finds the number of decode jobs in flight (and the number of encoder
+// threads) with the highest throughput during the first frames of a clip:
+// the number of jobs is doubled as long as the frame rate improves, encoder
+// threads are added whenever the encoders could not keep up.
+class Autotuner {
+	public:
+		Autotuner(unsigned int max_jobs, EncoderPool* encoders,
+				unsigned int max_encoders);
+
+		void		frame();
+		bool		is_done() { return done; }
+		unsigned int	get_jobs() { return jobs; }
+		float		get_fps() { return best_fps; }
+
+	private:
+		unsigned int	max_jobs;
+		EncoderPool*	encoders;
+		unsigned int	max_encoders;
+
+		std::atomic<unsigned int> jobs;
+		std::atomic<bool> done;
+
+		unsigned int	best_jobs;
+		float		best_fps;
+
+		unsigned int	frames;
+		unsigned long	stalls;
+		std::chrono::steady_clock::time_point start;
+
+		void		next_trial(unsigned int jobs);
+};
+
+// Per host profile: one line "host WxH format jobs encoders" per frame size
+// and output format.
+std::string profile_key(unsigned int width, unsigned int height,
+		const char* format);
+bool load_profile(const char* filename, const std::string& key,
+		unsigned int* jobs, unsigned int* encoders);
+bool save_profile(const char* filename, const std::string& key,
+		unsigned int jobs, unsigned int encoders);
+
+#endif
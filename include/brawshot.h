@@ -2,15 +2,25 @@
 #define __BRAWSHOT_H__
 
 #include <cstdint>
+#include <cstddef>
+#include <vector>
 
 #include "egl.h"
 #include "lut.h"
 #include "shader.h"
 
+// per channel histogram of the averaged frame, 64 values per bin
+#define	HISTOGRAM_BINS	1024
+
 class VideoProcessor {
 	public:
+		// With share, the processor joins the context group of share
+		// and uses its shaders and LUTs (lut_filename only selects the
+		// first LUT of share); share has to outlive it.
 		VideoProcessor(unsigned int width, unsigned int height,
-				float gain, const char* lut_filename);
+				float gain, const char* lut_filename,
+				unsigned int tile_height = 0,
+				VideoProcessor* share = nullptr);
 		~VideoProcessor();
 
 		void info() {
@@ -18,17 +28,94 @@ class VideoProcessor {
 			egl.info();
 		}
 
-		void		load_reference(uint16_t* image, bool after_lut);
+		static unsigned int tile_height_for_budget(unsigned int width,
+					unsigned int height, size_t budget,
+					bool use_ref, unsigned int ring = 0,
+					unsigned int deep = 0,
+					bool narrow = false);
+		static bool	narrow_accumulator(unsigned int window,
+					unsigned int input_bits,
+					unsigned int ring);
+
+		bool		resize(unsigned int width, unsigned int height,
+					unsigned int tile_height = 0);
+		unsigned int	get_bands();
+		size_t		get_gpu_memory();
+		void		set_input_stride(unsigned int stride);
+		bool		set_robust(unsigned int window, bool median,
+					float kappa);
+		void		set_window(unsigned int window,
+					unsigned int input_bits);
+		void		set_defects(const unsigned int* points,
+					unsigned int count);
+
+		void		load_reference(uint16_t* image, bool after_lut,
+					const unsigned int* mean = nullptr);
 		void		add(uint16_t* image);
 		void		subtract(uint16_t* image);
 		void		output(uint8_t* image);
 		void		output_raw(uint16_t* image);
+		void		set_deep_output(bool half);
+		void		output_deep(uint16_t* image, bool half);
+		void		histogram(float* bins);
+
+		float		get_gain();
+		void		set_gain(float gain);
+
+		int		add_lut(const char* filename);
+		void		select_lut(int index);
+
+		unsigned int	get_samples();
+		void		save_state(uint32_t* accumulator);
+		void		load_state(uint32_t* accumulator,
+					unsigned int samples);
 
 	private:
+		// A horizontal stripe of the frame with its own accumulator.
+		// Without tiling there is exactly one band.
+		struct Band {
+			unsigned int	y;
+			unsigned int	height;
+
+			GLuint		accumulation_tex;
+			GLuint		accumulation_fb;
+			GLuint		ref_tex;
+			GLuint		ring_tex;
+
+			// defective pixels of this band in the defect VBO
+			unsigned int	defect_first;
+			unsigned int	defect_count;
+		};
+
 		EGL		egl;
 
+		// the shaders and the first shared_luts LUTs belong to another
+		// processor of the group
+		bool		shared;
+		unsigned int	shared_luts;
+
+		static size_t	texture_memory(unsigned int width,
+					unsigned int height, bool use_ref,
+					unsigned int ring, unsigned int deep,
+					bool narrow, size_t* per_row);
+
+		void		allocate();
+		void		setup_accumulator(GLuint tex, unsigned int rows);
+		void		release();
+		void		clear();
+		void		accumulate(uint16_t* image, bool add);
+		void		allocate_ring(Band& band);
+		void		push(uint16_t* image);
+		void		resolve();
+		void		draw_defects(Band& band, GLuint defect,
+					GLuint bounds);
+		void		render(GLuint fb, GLenum format, GLenum type,
+					void* image, size_t pixel_size);
+
 		unsigned int	width;
 		unsigned int	height;
+		unsigned int	tile_height;
+		unsigned int	input_stride;
 
 		unsigned int	samples;
 
@@ -38,11 +125,31 @@ class VideoProcessor {
 		bool		use_ref;
 		bool		ref_after_lut;
 
+		// robust stacking keeps the last robust_window frames in a
+		// ring instead of a running sum
+		unsigned int	robust_window;
+		bool		robust_median;
+		float		robust_kappa;
+		unsigned int	ring_index;
+		unsigned int	ring_count;
+		bool		resolved;
+
+		// GL_RGB32UI, or GL_RGBA16UI if the sums fit into 16bit
+		GLenum		accumulator_format;
+
+		// enabled 16bit graded outputs
+		bool		deep_output;
+		bool		half_output;
+
+		// current LUT, nullptr for none
 		LUT*		lut;
+		std::vector<LUT*> luts;
 
 		Shader*		accumulate_shader;
 		Shader*		output_shader;
 		Shader*		output_raw_shader;
+		Shader*		robust_shader;
+		Shader*		histogram_shader;
 
 		GLuint		accumulate_shader_frame;
 		GLuint		accumulate_shader_tex;
@@ -57,28 +164,51 @@ class VideoProcessor {
 		GLuint		output_shader_use_lut;
 		GLuint		output_shader_use_ref;
 		GLuint		output_shader_ref_after_lut;
+		GLuint		output_shader_defect;
+		GLuint		output_shader_bounds;
 
 		GLuint		output_raw_shader_frame;
 		GLuint		output_raw_shader_samples;
+		GLuint		output_raw_shader_defect;
+		GLuint		output_raw_shader_bounds;
+
+		GLuint		robust_shader_frames;
+		GLuint		robust_shader_count;
+		GLuint		robust_shader_median;
+		GLuint		robust_shader_kappa;
+
+		GLuint		histogram_shader_frame;
+		GLuint		histogram_shader_samples;
+		GLuint		histogram_shader_size;
+		GLuint		histogram_shader_step;
+
+		std::vector<Band> bands;
 
 		GLuint		input_tex;
-		GLuint		input_ref_tex;
-		GLuint		accumulation_1_tex;
-		GLuint		accumulation_2_tex;
+		GLuint		accumulation_tex;
 		GLuint		output_tex;
 		GLuint		output_raw_tex;
+		GLuint		output_deep_tex;
+		GLuint		output_half_tex;
 
 		GLuint		lut_tex;
+		std::vector<GLuint> lut_textures;
+		GLuint		histogram_tex;
 
-		GLuint		accumulation_1_fb;
-		GLuint		accumulation_2_fb;
+		GLuint		accumulation_fb;
 		GLuint		output_fb;
 		GLuint		output_raw_fb;
+		GLuint		output_deep_fb;
+		GLuint		output_half_fb;
+		GLuint		histogram_fb;
 
 		GLuint		quad_vbo;
 		GLuint		quad_vao;
 
-		bool		current_accumulator;
+		GLuint		defect_vbo;
+		GLuint		defect_vao;
+
+		GLuint		histogram_vao;
 };
 
 #endif
@@ -0,0 +1,74 @@
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+enum HugePages {
+	HUGE_PAGES_OFF,
+	HUGE_PAGES_TRANSPARENT,		// madvise(MADV_HUGEPAGE)
+	HUGE_PAGES_EXPLICIT		// MAP_HUGETLB, from the reserved pool
+};
+
+class BufferPool;
+
+// A buffer of a BufferPool, which returns to the pool when the handle is
+// destroyed. Handles can only be moved, so every buffer has a single owner
+// as it travels from the readback to the encoder and the writer.
+class FrameBuffer {
+	public:
+		FrameBuffer() : pool(nullptr), data(nullptr) {}
+		FrameBuffer(BufferPool* pool, void* data)
+			: pool(pool), data(data) {}
+		FrameBuffer(FrameBuffer&& other);
+		FrameBuffer(const FrameBuffer&) = delete;
+		~FrameBuffer();
+
+		FrameBuffer&	operator=(FrameBuffer&& other);
+		FrameBuffer&	operator=(const FrameBuffer&) = delete;
+
+		template<typename T> T* get() { return (T*) data; }
+		void		reset();
+
+	private:
+		BufferPool*	pool;
+		void*		data;
+};
+
+// Fixed size, page aligned buffers which are reused instead of allocating
+// (and page faulting) a new frame for every output. The buffers are
+// allocated on demand and only freed with the pool, so the number of buffers
+// settles at the depth of the pipeline. With max_idle, buffers returned while
+// that many are idle already are freed right away.
+class BufferPool {
+	public:
+		BufferPool(size_t size, HugePages huge_pages, bool lock,
+				unsigned int max_idle = 0);
+		~BufferPool();
+
+		FrameBuffer	acquire();
+		size_t		get_size() { return size; }
+		unsigned int	get_count();
+
+		// the size the buffers are mapped with
+		static size_t	page_size(HugePages huge_pages);
+
+	private:
+		friend class FrameBuffer;
+
+		size_t		size;
+		size_t		mapped_size;
+		HugePages	huge_pages;
+		bool		lock_pages;
+		unsigned int	max_idle;
+
+		std::mutex	lock;
+		std::vector<void*> idle;
+		unsigned int	count;
+
+		void*		allocate();
+		void		release(void* data);
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <cstdint>
+
+#include "brawshot.h"
+
+class Checkpoint {
+	public:
+		Checkpoint(const char* filename, const char* options,
+				unsigned int width, unsigned int height);
+		~Checkpoint();
+
+		bool		save(VideoProcessor* processor,
+					unsigned long frame);
+		bool		load(VideoProcessor* processor,
+					unsigned long* frame);
+		void		remove();
+
+	private:
+		char*		filename;
+		uint64_t	hash;
+
+		unsigned int	width;
+		unsigned int	height;
+
+		uint32_t*	accumulator;
+};
+
+#endif
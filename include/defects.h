@@ -0,0 +1,37 @@
+#ifndef __DEFECTS_H__
+#define __DEFECTS_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Defect maps are small text files with the frame size in the first line
+// followed by the x/y coordinates of one defective pixel per line.
+class DefectMap {
+	public:
+		DefectMap();
+
+		void		find(const uint16_t* image, unsigned int width,
+					unsigned int height, float sigma);
+		bool		load(const char* filename);
+		std::string	format();
+
+		std::vector<unsigned int> transform(unsigned int width,
+					unsigned int height,
+					unsigned int offset_x,
+					unsigned int offset_y,
+					unsigned int crop_width,
+					unsigned int crop_height);
+
+		bool		matches(unsigned int width, unsigned int height);
+		unsigned int	get_count();
+
+	private:
+		unsigned int	width;
+		unsigned int	height;
+
+		// x/y pairs
+		std::vector<unsigned int> points;
+};
+
+#endif
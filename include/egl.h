@@ -1,12 +1,18 @@
 #ifndef __EGL_H__
 #define __EGL_H__
 
+#include <memory>
+#include <mutex>
 #include <GL/gl.h>
 #include <EGL/egl.h>
 
+// An EGL context. Contexts created with share belong to its group: they
+// share textures and programs, and only one context of a group is current
+// at a time, so that one context never sees the uniforms another one is
+// still setting up.
 class EGL {
 	public:
-		EGL();
+		EGL(EGL* share = nullptr);
 		~EGL();
 
 		void		info();
@@ -19,7 +25,10 @@ class EGL {
 		EGLint		minor;
 		EGLContext	context;
 
-		bool		init();
+		std::shared_ptr<std::mutex> group_lock;
+		bool		locked;
+
+		bool		init(EGL* share);
 		bool		error();
 		const char*	error_msg(EGLint err);
 };
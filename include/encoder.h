@@ -0,0 +1,61 @@
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+enum ImageFormat {
+	FORMAT_JPEG,		// 8bit, turbojpeg
+	FORMAT_TIFF,		// 16bit RGB, uncompressed or deflate
+	FORMAT_PNG,		// 16bit RGB, deflate
+	FORMAT_EXR		// half float RGB, uncompressed or ZIP
+};
+
+// The encoders take RGBA images with 16bit per channel (half floats for EXR)
+// and drop the alpha channel. level is the zlib compression level (0-9); 0
+// writes uncompressed TIFF and EXR files.
+std::vector<uint8_t> encode_tiff(const uint16_t* image, unsigned int width,
+		unsigned int height, int level);
+std::vector<uint8_t> encode_png(const uint16_t* image, unsigned int width,
+		unsigned int height, int level);
+std::vector<uint8_t> encode_exr(const uint16_t* image, unsigned int width,
+		unsigned int height, int level);
+
+const char* format_extension(ImageFormat format);
+
+// Runs the encoding of the 16bit images on several threads, as a single
+// deflate stream is far slower than the GPU. At most 2 jobs per thread are
+// queued, submit blocks otherwise.
+class EncoderPool {
+	public:
+		EncoderPool(unsigned int threads);
+		~EncoderPool();
+
+		void		submit(const std::function<void()>& job);
+		void		wait();
+
+		void		add_thread();
+		unsigned int	get_threads();
+		unsigned long	get_stalls();
+		unsigned int	get_queued();
+
+	private:
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()>> queue;
+		std::mutex	lock;
+		std::condition_variable cv;
+		unsigned int	busy;
+		bool		done;
+
+		// submissions which had to wait for a free thread
+		unsigned long	stalls;
+
+		void		run();
+};
+
+#endif
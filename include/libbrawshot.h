@@ -0,0 +1,111 @@
+#ifndef __LIBBRAWSHOT_H__
+#define __LIBBRAWSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	BRAWSHOT_API	__attribute__((visibility("default")))
+
+// Temporal filter of brawshot as a library: RGBA frames with 16bit per
+// channel are pushed in, and every frame once the window is full produces a
+// filtered output frame. The frames are uploaded to the GPU straight from
+// the caller's memory and read back straight into the output buffer.
+//
+// A filter has its own EGL context and may be driven from any thread, but
+// only from one thread at a time. Like in the command line tool, GL errors
+// terminate the process.
+
+typedef struct brawshot brawshot_t;
+
+typedef enum {
+	BRAWSHOT_OUTPUT_BGRA8,		// graded, 8bit BGRA (4 bytes per pixel)
+	BRAWSHOT_OUTPUT_RAW16,		// mean without gain/LUT, 16bit RGBA
+	BRAWSHOT_OUTPUT_GRADED16,	// graded, 16bit RGBA
+	BRAWSHOT_OUTPUT_HALF		// graded, half float RGBA
+} brawshot_output_t;
+
+typedef struct {
+	unsigned int	width;		// size of the output frames
+	unsigned int	height;
+	unsigned int	stride;		// pixels per input row, 0 for width
+	unsigned int	window;		// frames per output frame
+	float		gain;
+	const char*	lut_filename;	// .cube LUT, or NULL
+	brawshot_output_t output;
+	unsigned int	robust;		// 0, or BRAWSHOT_ROBUST_*
+	float		kappa;		// sigma clipping threshold
+	size_t		vram_budget;	// bytes, 0 to process whole frames
+	unsigned int	input_bits;	// significant bits of the input, 0
+					// for 16; fewer bits allow a 16bit
+					// accumulator for larger windows
+} brawshot_config_t;
+
+#define	BRAWSHOT_ROBUST_SIGMA	1
+#define	BRAWSHOT_ROBUST_MEDIAN	2
+
+// Called once the filter does not need an input frame any more; frame_data
+// is the value passed to brawshot_push. Without robust stacking, the last
+// window frames are read again when they leave the window, so they have to
+// stay valid until they are released.
+typedef void (*brawshot_release_t)(void* opaque, void* frame_data);
+
+// Called with every output frame unless it is read into a buffer passed to
+// brawshot_push; image is only valid during the call.
+typedef void (*brawshot_output_cb_t)(void* opaque, const void* image,
+		unsigned long index);
+
+BRAWSHOT_API brawshot_t* brawshot_create(const brawshot_config_t* config,
+		brawshot_output_cb_t output, brawshot_release_t release,
+		void* opaque);
+
+// Releases all frames which are still in the window.
+BRAWSHOT_API void brawshot_destroy(brawshot_t* filter);
+
+// Subtracts the reference frame (a full input frame, with the stride of the
+// input frames) from every output frame, before or after the LUT.
+BRAWSHOT_API void brawshot_load_reference(brawshot_t* filter,
+		const uint16_t* image, int after_lut);
+
+// Adds a frame. Returns 1 if it completed an output frame, which is then
+// read into output (brawshot_frame_size bytes) or, if output is NULL,
+// passed to the output callback. Returns 0 while the window fills up.
+BRAWSHOT_API int brawshot_push(brawshot_t* filter, const uint16_t* frame,
+		void* frame_data, void* output);
+
+// Instead of brawshot_push, the caller may keep track of the window itself
+// and pass the frame which leaves it to brawshot_subtract, e.g. after
+// decoding it again, so the frames do not have to stay in memory until they
+// leave the window. brawshot_add adds a frame without keeping it and returns
+// 1 once the window is full, then brawshot_read reads the output frame of
+// the window (brawshot_frame_size bytes). With robust stacking the oldest
+// frame leaves the window by itself and brawshot_subtract does nothing.
+BRAWSHOT_API int brawshot_add(brawshot_t* filter, const uint16_t* frame);
+BRAWSHOT_API void brawshot_subtract(brawshot_t* filter, const uint16_t* frame);
+BRAWSHOT_API void brawshot_read(brawshot_t* filter, void* output);
+
+BRAWSHOT_API size_t brawshot_frame_size(const brawshot_t* filter);
+BRAWSHOT_API void brawshot_set_gain(brawshot_t* filter, float gain);
+
+#ifdef __cplusplus
+}
+
+class VideoProcessor;
+
+// For the command line tool, which sets up its processors itself (context
+// groups, additional LUTs, defect maps, checkpoints): a filter which drives
+// an existing processor and does not delete it. Only the size, window and
+// output of config are used. Neither is exported from the shared library.
+brawshot_t* brawshot_attach(VideoProcessor* processor,
+		const brawshot_config_t* config);
+
+// brawshot_load_reference with a known mean of the frame, e.g. from the
+// header of a master dark, or NULL to compute it.
+void brawshot_load_reference_mean(brawshot_t* filter, const uint16_t* image,
+		int after_lut, const unsigned int* mean);
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __MATROSKA_H__
+#define __MATROSKA_H__
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Writes JPEG frames into a single Matroska file (V_MJPEG) with an index,
+// which ffmpeg and most editors can read directly. Frames are collected in
+// clusters in memory and written with one large write per cluster.
+class MatroskaWriter {
+	public:
+		MatroskaWriter(const char* filename, unsigned int width,
+				unsigned int height, float fps);
+		~MatroskaWriter();
+
+		void		reserve(unsigned long index);
+		void		write(const void* data, size_t size,
+					unsigned long index);
+		void		close();
+
+	private:
+		struct CuePoint {
+			uint64_t	time;
+			uint64_t	position;
+		};
+
+		char*		filename;
+		FILE*		file;
+		float		fps;
+
+		uint64_t	segment_start;
+		uint64_t	segment_size_pos;
+		uint64_t	cues_seek_pos;
+		uint64_t	duration_pos;
+
+		std::vector<uint8_t> cluster;
+		uint64_t	cluster_time;
+		uint64_t	last_time;
+		bool		empty;
+
+		std::vector<CuePoint> cues;
+
+		// frames are encoded concurrently but written in reserve order
+		std::deque<unsigned long> order;
+		std::mutex	lock;
+		std::condition_variable cv;
+
+		void		flush();
+		void		write_at(uint64_t position, const void* data,
+					size_t size);
+		uint64_t	timestamp(unsigned long index);
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <thread>
+
+// Counters of the pipeline. The stages only increment them (relaxed atomics,
+// no locks); the queue depths are sampled by the exporter.
+struct Metrics {
+	std::atomic<uint64_t>	decoded;
+	std::atomic<uint64_t>	accumulated;
+	std::atomic<uint64_t>	encoded;
+	std::atomic<uint64_t>	written;
+	std::atomic<uint64_t>	bytes_written;
+
+	// progress of the clips being processed, for the ETA
+	std::atomic<uint64_t>	clip_frames;
+	std::atomic<uint64_t>	clip_done;
+
+	// sampled before every export
+	std::atomic<unsigned int> decode_queue;
+	std::atomic<unsigned int> apply_queue;
+	std::atomic<unsigned int> encode_queue;
+	std::atomic<unsigned int> write_queue;
+	std::atomic<uint64_t>	gpu_memory;
+
+	Metrics();
+
+	static void add(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+		counter.fetch_add(value, std::memory_order_relaxed);
+	}
+};
+
+// Publishes the metrics every interval seconds from its own thread: as a
+// Prometheus textfile (or a JSON file, if the name ends with .json) which is
+// rewritten atomically, and optionally over HTTP on a Unix socket.
+class MetricsExporter {
+	public:
+		MetricsExporter(Metrics* metrics, const char* filename,
+				const char* socket_path, unsigned int interval,
+				const std::function<void()>& sample);
+		~MetricsExporter();
+
+		bool		is_listening() { return listen_fd >= 0; }
+
+	private:
+		Metrics*	metrics;
+		const char*	filename;
+		const char*	socket_path;
+		unsigned int	interval;
+		std::function<void()> sample;
+		bool		json;
+		int		listen_fd;
+
+		// frame rate, smoothed over the exports
+		std::chrono::steady_clock::time_point last;
+		uint64_t	last_accumulated;
+		float		fps;
+
+		std::mutex	lock;
+		std::condition_variable cv;
+		bool		done;
+		std::thread	thread;
+
+		void		run();
+		void		update();
+		std::string	format();
+		void		serve();
+};
+
+#endif
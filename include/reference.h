@@ -0,0 +1,31 @@
+#ifndef __REFERENCE_H__
+#define __REFERENCE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#define	REFERENCE_MAGIC		"BRAWDARK"
+#define	REFERENCE_VERSION	1
+
+// Reference (dark) frames are raw dumps in the format of
+// VideoProcessor::output_raw. Master darks built with --build-dark are
+// preceded by this header, so the mean does not have to be recomputed.
+struct ReferenceHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	frames;
+	uint32_t	mean[4];
+};
+
+void		reference_mean(const uint16_t* image, unsigned int width,
+			unsigned int height, unsigned int stride,
+			unsigned int* mean);
+void		reference_header(ReferenceHeader* header,
+			const uint16_t* image, unsigned int width,
+			unsigned int height, unsigned long frames);
+uint16_t*	read_reference(const char* filename, size_t* pixels,
+			ReferenceHeader* header, bool* has_header);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef __RESOURCES_H__
+#define __RESOURCES_H__
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "BlackmagicRawAPI.h"
+
+#include "bufferpool.h"
+
+// Resource manager for the BRAW SDK which places the frame sized CPU buffers
+// (including the decoded frames) in page aligned, reusable buffers, so the
+// frames handed to ProcessComplete are uploaded straight from pooled memory.
+// The requests are rounded up to size classes with a BufferPool each, so
+// that the compressed frames, whose size differs from frame to frame, share
+// a few pools. Small CPU buffers and all GPU resources are left to the SDK's
+// own manager.
+class PooledResourceManager : public IBlackmagicRawResourceManager
+{
+	public:
+		PooledResourceManager(HugePages huge_pages, bool lock);
+		virtual ~PooledResourceManager();
+
+		bool		install(IBlackmagicRaw* codec);
+
+		virtual HRESULT CreateResource(void* context, void* commandQueue,
+				uint32_t sizeBytes,
+				BlackmagicRawResourceType type,
+				BlackmagicRawResourceUsage usage,
+				void** resource);
+		virtual HRESULT ReleaseResource(void* context,
+				void* commandQueue, void* resource,
+				BlackmagicRawResourceType type);
+		virtual HRESULT CopyResource(void* context, void* commandQueue,
+				void* source,
+				BlackmagicRawResourceType sourceType,
+				void* destination,
+				BlackmagicRawResourceType destinationType,
+				uint32_t sizeBytes, bool copyAsync);
+		virtual HRESULT GetResourceHostPointer(void* context,
+				void* commandQueue, void* resource,
+				BlackmagicRawResourceType resourceType,
+				void** hostPointer);
+
+		virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID,
+				LPVOID*) {
+			return E_NOTIMPL;
+		}
+
+		virtual ULONG STDMETHODCALLTYPE AddRef(void) {
+			return 0;
+		}
+
+		virtual ULONG STDMETHODCALLTYPE Release(void) {
+			return 0;
+		}
+
+	private:
+		HugePages	huge_pages;
+		bool		lock_pages;
+
+		IBlackmagicRawResourceManager* fallback;
+
+		std::mutex	lock;
+		std::map<size_t, BufferPool*> pools;
+		std::map<void*, FrameBuffer> resources;
+
+		size_t		size_class(uint32_t size);
+		bool		pooled(void* resource);
+};
+
+#endif
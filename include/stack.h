@@ -0,0 +1,46 @@
+#ifndef __STACK_H__
+#define __STACK_H__
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// Sums up an unlimited number of frames in parallel. Every decode job adds
+// its frame to one of several 32bit partial sums, which are spilled into a
+// 64bit total before they can overflow.
+class Stack {
+	public:
+		Stack(unsigned int width, unsigned int height,
+				unsigned int partials);
+		~Stack();
+
+		void		add(const uint16_t* image, unsigned int stride);
+		unsigned long	get_count();
+
+		void		mean(uint32_t* accumulator);
+		void		mean_raw(uint16_t* image);
+
+	private:
+		struct Partial {
+			uint32_t*	sum;
+			unsigned int	count;
+		};
+
+		unsigned int	width;
+		unsigned int	height;
+
+		std::vector<Partial> partials;
+		std::vector<unsigned int> idle;
+		std::mutex	partials_lock;
+		std::condition_variable partials_cv;
+
+		uint64_t*	total;
+		unsigned long	total_count;
+		std::mutex	total_lock;
+
+		void		spill(Partial& partial);
+		void		reduce(uint32_t* mean);
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "bufferpool.h"
+
+enum StreamFormat {
+	STREAM_Y4M,		// 8bit YUV 4:4:4 (BT.709)
+	STREAM_BGRA,		// 8bit BGRA from the output shader
+	STREAM_RGB48		// 16bit RGB from the RAW output shader
+};
+
+// Writes the output frames to a file descriptor (usually a pipe) from a
+// separate thread, so the GL thread never waits for the consumer unless
+// the queue is full.
+class StreamWriter {
+	public:
+		StreamWriter(int fd, StreamFormat format, unsigned int width,
+				unsigned int height, float fps);
+		~StreamWriter();
+
+		void		reserve(unsigned long index);
+		bool		push(FrameBuffer image, unsigned long index);
+
+	private:
+		int		fd;
+		StreamFormat	format;
+		unsigned int	width;
+		unsigned int	height;
+
+		std::deque<FrameBuffer> queue;
+		std::deque<unsigned long> order;
+		std::mutex	lock;
+		std::condition_variable cv;
+		bool		done;
+		std::atomic<bool> failed;
+		std::thread	thread;
+
+		uint8_t*	buffer;
+
+		void		run();
+		void		convert(void* image);
+		bool		write_all(const void* data, size_t size);
+		size_t		frame_size();
+};
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+// Self check of the GPU pipeline on the current driver: synthetic frames are
+// pushed through VideoProcessor for several window sizes, tilings,
+// references, LUTs and robust modes. The RAW output of the sliding window
+// has to match a CPU sum, median or kappa-sigma clipped mean of the window,
+// and the incremental add/subtract has to produce the same graded output as
+// a fresh accumulation of the window with the 32bit accumulator, whichever
+// accumulator the window itself uses. One more check pushes the frames with a
+// row stride and a strided reference frame through the libbrawshot API.
+//
+// The frame rate of the throughput checks, which are timed after a warm-up,
+// is compared against baseline_filename (if given): a check which got more
+// than threshold percent slower fails, and checks without a baseline are
+// added to the file.
+bool run_verify(const char* baseline_filename, float threshold);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+enum FsyncPolicy {
+	FSYNC_NONE,		// leave it to the page cache
+	FSYNC_FILE,		// fsync every file before it is renamed
+	FSYNC_END		// sync the file system once at the end of a clip
+};
+
+// Writes the output files in the background. Like write_file, every file is
+// written under a temporary name and renamed when complete. The files are
+// submitted in batches through io_uring; if io_uring is not available (or
+// threads is requested), a pool of threads writes them instead. Every
+// completed file is counted in metrics, if given.
+class FileWriter {
+	public:
+		FileWriter(bool use_uring, unsigned int threads,
+				FsyncPolicy fsync, bool direct,
+				Metrics* metrics = nullptr);
+		~FileWriter();
+
+		// Takes ownership of data, release is called once it is
+		// written. Blocks if too many files are pending.
+		void		write(const char* filename, const void* data,
+					size_t size,
+					const std::function<void()>& release);
+		void		wait();
+
+		// Applies the fsync policy to the directory of filename, like
+		// wait, but without waiting for the other files.
+		void		sync(const std::string& filename);
+
+		bool		using_uring() { return ring_fd >= 0; }
+		unsigned int	get_pending();
+
+	private:
+		struct Job {
+			std::string	filename;
+			std::string	tmpname;
+			const void*	data;
+			size_t		size;
+			size_t		written;
+			size_t		length;
+			std::function<void()> release;
+			void*		aligned;
+			int		fd;
+			unsigned int	pending;
+		};
+
+		FsyncPolicy	fsync_policy;
+		bool		direct;
+		Metrics*	metrics;
+
+		std::deque<Job*> queue;
+		std::mutex	lock;
+		std::condition_variable cv;
+		unsigned int	busy;
+		bool		done;
+		std::string	sync_dir;
+		std::vector<std::thread> threads;
+
+		// io_uring
+		int		ring_fd;
+		void*		sq_ring;
+		void*		cq_ring;
+		size_t		sq_ring_size;
+		size_t		cq_ring_size;
+		void*		sqes;
+		size_t		sqes_size;
+		unsigned int	sq_entries;
+		unsigned int*	sq_head;
+		unsigned int*	sq_tail;
+		unsigned int*	sq_mask;
+		unsigned int*	sq_array;
+		unsigned int*	cq_head;
+		unsigned int*	cq_tail;
+		unsigned int*	cq_mask;
+		void*		cqes;
+
+		bool		setup_uring();
+		void		run_uring();
+		void		run_threads();
+
+		void		sync_directory(const std::string& dir);
+
+		void		open_job(Job* job);
+		void		finish_job(Job* job);
+		void		write_rest(Job* job);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "brawshot.h"
+#include "autogain.h"
+
+// weight of the gain of the current frame when smoothing
+#define	SMOOTHING	0.05f
+
+AutoGain::AutoGain(bool smooth, float percentile, float target)
+	: smooth(smooth), p(percentile), target(target), valid(false),
+		gain(1.0f)
+{
+}
+
+// Forgets the gain of the previous clip.
+void AutoGain::reset()
+{
+	valid = false;
+}
+
+// Returns the gain for the frame with the given histogram; gain is the
+// current gain, which is kept if the frame is black.
+float AutoGain::update(const float* bins, float gain)
+{
+	if(valid && !smooth) {
+		return this->gain;
+	}
+
+	// the brightest channel must not clip
+	unsigned int value = 0;
+	for(unsigned int c = 0; c < 3; c++) {
+		unsigned int v = percentile(bins, c, p);
+		if(v > value) {
+			value = v;
+		}
+	}
+
+	if(value == 0) {
+		return valid ? this->gain : gain;
+	}
+
+	float wanted = target * 65535.0f / value;
+	if(valid) {
+		this->gain += (wanted - this->gain) * SMOOTHING;
+	} else {
+		this->gain = wanted;
+		valid = true;
+	}
+
+	return this->gain;
+}
+
+// Value below which p percent of the samples of a channel are, at the center
+// of the bin.
+unsigned int AutoGain::percentile(const float* bins, unsigned int channel,
+		float p)
+{
+	const float* row = bins + channel * HISTOGRAM_BINS;
+
+	double total = 0;
+	for(unsigned int i = 0; i < HISTOGRAM_BINS; i++) {
+		total += row[i];
+	}
+
+	double limit = total * p / 100.0;
+	double count = 0;
+	unsigned int bin = 0;
+	for(; bin < HISTOGRAM_BINS - 1; bin++) {
+		count += row[bin];
+		if(count >= limit) {
+			break;
+		}
+	}
+
+	unsigned int size = 65536 / HISTOGRAM_BINS;
+	return bin * size + size / 2;
+}
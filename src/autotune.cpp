@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+
+#include "autotune.h"
+
+// frames to fill the pipeline after a change (plus 2 per job) and frames
+// which are measured per trial
+#define	TUNE_WARMUP	4
+#define	TUNE_FRAMES	32
+
+// minimal improvement for more jobs to count as faster
+#define	TUNE_GAIN	1.05f
+
+Autotuner::Autotuner(unsigned int max_jobs, EncoderPool* encoders,
+		unsigned int max_encoders)
+	: max_jobs(max_jobs), encoders(encoders), max_encoders(max_encoders),
+		jobs(1), done(false), best_jobs(1), best_fps(0)
+{
+	next_trial(1);
+}
+
+void Autotuner::next_trial(unsigned int count)
+{
+	jobs = count;
+	frames = 0;
+}
+
+// Called for every frame which was applied, in order.
+void Autotuner::frame()
+{
+	if(done) {
+		return;
+	}
+
+	frames++;
+
+	unsigned int warmup = TUNE_WARMUP + 2 * jobs;
+	if(frames == warmup) {
+		start = std::chrono::steady_clock::now();
+		stalls = encoders != nullptr ? encoders->get_stalls() : 0;
+		return;
+	} else if(frames < warmup + TUNE_FRAMES) {
+		return;
+	}
+
+	std::chrono::duration<float> seconds =
+		std::chrono::steady_clock::now() - start;
+	float fps = TUNE_FRAMES / seconds.count();
+
+	if(encoders != nullptr && encoders->get_threads() < max_encoders &&
+			encoders->get_stalls() - stalls > TUNE_FRAMES / 4) {
+		// the encoders held the pipeline back, so this trial says
+		// little about the decoder; repeat it with another thread
+		encoders->add_thread();
+		next_trial(jobs);
+		return;
+	}
+
+	if(fps > best_fps * TUNE_GAIN) {
+		best_fps = fps;
+		best_jobs = jobs;
+
+		unsigned int next = jobs * 2 > max_jobs ? max_jobs : jobs * 2;
+		if(next > jobs) {
+			next_trial(next);
+			return;
+		}
+	}
+
+	jobs = best_jobs;
+	done = true;
+}
+
+std::string profile_key(unsigned int width, unsigned int height,
+		const char* format)
+{
+	char host[256] = "localhost";
+	gethostname(host, sizeof(host) - 1);
+
+	char key[512];
+	snprintf(key, sizeof(key), "%s %ux%u %s", host, width, height, format);
+	return key;
+}
+
+static std::vector<std::string> read_lines(const char* filename)
+{
+	std::vector<std::string> lines;
+
+	FILE* f = fopen(filename, "rt");
+	if(!f) {
+		return lines;
+	}
+
+	char line[1024];
+	while(fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		lines.push_back(line);
+	}
+	fclose(f);
+
+	return lines;
+}
+
+bool load_profile(const char* filename, const std::string& key,
+		unsigned int* jobs, unsigned int* encoders)
+{
+	for(const std::string& line : read_lines(filename)) {
+		if(line.compare(0, key.size(), key) != 0 ||
+				line.size() <= key.size() ||
+				line[key.size()] != ' ') {
+			continue;
+		}
+
+		return sscanf(line.c_str() + key.size(), "%u %u", jobs,
+				encoders) == 2 && *jobs > 0;
+	}
+
+	return false;
+}
+
+// Replaces the entry for key (or appends it); the file is rewritten
+// atomically, so concurrent runs never see a partial profile.
+bool save_profile(const char* filename, const std::string& key,
+		unsigned int jobs, unsigned int encoders)
+{
+	std::vector<std::string> lines = read_lines(filename);
+
+	char entry[1024];
+	snprintf(entry, sizeof(entry), "%s %u %u", key.c_str(), jobs, encoders);
+
+	bool found = false;
+	for(std::string& line : lines) {
+		if(line.compare(0, key.size(), key) == 0 &&
+				line.size() > key.size() &&
+				line[key.size()] == ' ') {
+			line = entry;
+			found = true;
+		}
+	}
+	if(!found) {
+		lines.push_back(entry);
+	}
+
+	std::string tmpname = std::string(filename) + ".part";
+	FILE* f = fopen(tmpname.c_str(), "wt");
+	if(!f) {
+		printf("Error creating %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+		return false;
+	}
+	for(const std::string& line : lines) {
+		fprintf(f, "%s\n", line.c_str());
+	}
+	fclose(f);
+
+	if(rename(tmpname.c_str(), filename) != 0) {
+		printf("Error renaming %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bufferpool.h"
+
+#define	HUGE_PAGE_SIZE	(2UL << 20)
+
+FrameBuffer::FrameBuffer(FrameBuffer&& other)
+	: pool(other.pool), data(other.data)
+{
+	other.pool = nullptr;
+	other.data = nullptr;
+}
+
+FrameBuffer::~FrameBuffer()
+{
+	reset();
+}
+
+FrameBuffer& FrameBuffer::operator=(FrameBuffer&& other)
+{
+	if(this != &other) {
+		reset();
+		pool = other.pool;
+		data = other.data;
+		other.pool = nullptr;
+		other.data = nullptr;
+	}
+	return *this;
+}
+
+// Returns the buffer to its pool.
+void FrameBuffer::reset()
+{
+	if(data != nullptr) {
+		pool->release(data);
+		pool = nullptr;
+		data = nullptr;
+	}
+}
+
+BufferPool::BufferPool(size_t size, HugePages huge_pages, bool lock,
+		unsigned int max_idle)
+	: size(size), huge_pages(huge_pages), lock_pages(lock),
+	max_idle(max_idle), count(0)
+{
+	size_t page = page_size(huge_pages);
+	mapped_size = (size + page - 1) / page * page;
+}
+
+size_t BufferPool::page_size(HugePages huge_pages)
+{
+	return huge_pages == HUGE_PAGES_OFF ? sysconf(_SC_PAGESIZE) :
+		HUGE_PAGE_SIZE;
+}
+
+// All buffers must have been returned.
+BufferPool::~BufferPool()
+{
+	for(void* data : idle) {
+		munmap(data, mapped_size);
+	}
+}
+
+void* BufferPool::allocate()
+{
+	void* data = MAP_FAILED;
+
+	if(huge_pages == HUGE_PAGES_EXPLICIT) {
+		data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+				MAP_POPULATE, -1, 0);
+		if(data == MAP_FAILED) {
+			printf("No huge pages available, using transparent huge pages\n");
+			huge_pages = HUGE_PAGES_TRANSPARENT;
+		}
+	}
+
+	if(data == MAP_FAILED) {
+		data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(data == MAP_FAILED) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+
+		if(huge_pages == HUGE_PAGES_TRANSPARENT) {
+			madvise(data, mapped_size, MADV_HUGEPAGE);
+		}
+
+		// fault the pages in now instead of during the first readback
+		madvise(data, mapped_size, MADV_WILLNEED);
+		for(size_t i = 0; i < mapped_size; i += 4096) {
+			((volatile char*) data)[i] = 0;
+		}
+	}
+
+	if(lock_pages && mlock(data, mapped_size) != 0) {
+		printf("Cannot lock the frame buffers: %s\n", strerror(errno));
+		lock_pages = false;
+	}
+
+	return data;
+}
+
+// Returns an idle buffer, or a new one if all are in use. New buffers are
+// rare once the pipeline is full, so they are allocated under the lock.
+FrameBuffer BufferPool::acquire()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if(!idle.empty()) {
+		void* data = idle.back();
+		idle.pop_back();
+		return FrameBuffer(this, data);
+	}
+
+	count++;
+	return FrameBuffer(this, allocate());
+}
+
+void BufferPool::release(void* data)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(max_idle == 0 || idle.size() < max_idle) {
+			idle.push_back(data);
+			return;
+		}
+	}
+
+	munmap(data, mapped_size);
+}
+
+// Number of buffers allocated so far.
+unsigned int BufferPool::get_count()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return count;
+}
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#define	CHECKPOINT_MAGIC	"BRAWCKPT"
+#define	CHECKPOINT_VERSION	1
+
+struct CheckpointHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	samples;
+	uint64_t	hash;
+	uint64_t	frame;
+	uint32_t	width;
+	uint32_t	height;
+};
+
+// FNV-1a, only used to detect a resume with different options
+static uint64_t hash_string(const char* s)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for(; *s; s++) {
+		hash ^= (uint8_t) *s;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+Checkpoint::Checkpoint(const char* filename, const char* options,
+		unsigned int width, unsigned int height)
+	: width(width), height(height)
+{
+	this->filename = strdup(filename);
+	hash = hash_string(options);
+	accumulator = new uint32_t[width * height * 3];
+}
+
+Checkpoint::~Checkpoint()
+{
+	delete[] accumulator;
+	free(filename);
+}
+
+bool Checkpoint::save(VideoProcessor* processor, unsigned long frame)
+{
+	CheckpointHeader hdr;
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	hdr.version = CHECKPOINT_VERSION;
+	hdr.samples = processor->get_samples();
+	hdr.hash = hash;
+	hdr.frame = frame;
+	hdr.width = width;
+	hdr.height = height;
+
+	processor->save_state(accumulator);
+
+	// write to a temporary file first so that a crash while writing never
+	// destroys the previous checkpoint
+	char tmpname[256];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	FILE* f = fopen(tmpname, "wb");
+	if(!f) {
+		printf("Error creating %s: %s\n", tmpname, strerror(errno));
+		return false;
+	}
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	ok = ok && fwrite(accumulator, width * height * sizeof(uint32_t), 3,
+			f) == 3;
+	ok = ok && fflush(f) == 0;
+	ok = ok && fsync(fileno(f)) == 0;
+	fclose(f);
+
+	if(!ok || rename(tmpname, filename) != 0) {
+		printf("Error writing %s: %s\n", filename, strerror(errno));
+		unlink(tmpname);
+		return false;
+	}
+
+	return true;
+}
+
+bool Checkpoint::load(VideoProcessor* processor, unsigned long* frame)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		return false;
+	}
+
+	CheckpointHeader hdr;
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) ||
+			hdr.version != CHECKPOINT_VERSION) {
+		printf("Invalid checkpoint file %s\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	if(hdr.hash != hash || hdr.width != width || hdr.height != height) {
+		printf("Checkpoint %s was created with different options\n",
+				filename);
+		fclose(f);
+		return false;
+	}
+
+	if(fread(accumulator, width * height * sizeof(uint32_t), 3, f) != 3) {
+		printf("Checkpoint %s is truncated\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	fclose(f);
+
+	processor->load_state(accumulator, hdr.samples);
+	*frame = hdr.frame;
+
+	return true;
+}
+
+void Checkpoint::remove()
+{
+	unlink(filename);
+}
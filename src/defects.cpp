@@ -0,0 +1,180 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include "defects.h"
+
+#define	DEFECTS_MAGIC	"# brawshot defects"
+
+DefectMap::DefectMap() : width(0), height(0)
+{
+}
+
+// Finds pixels which differ from the median of their neighbours by more than
+// sigma times the (robustly estimated) noise of the frame. Meant for the mean
+// of a dark clip, where hot pixels stand out and dead pixels fall below the
+// black level of their neighbours.
+void DefectMap::find(const uint16_t* image, unsigned int width,
+		unsigned int height, float sigma)
+{
+	this->width = width;
+	this->height = height;
+	points.clear();
+
+	// largest deviation of any channel from the neighbourhood median
+	std::vector<uint16_t> deviation((size_t) width * height, 0);
+	std::vector<uint32_t> histogram(65536, 0);
+
+	for(unsigned int y = 0; y < height; y++) {
+		for(unsigned int x = 0; x < width; x++) {
+			const uint16_t* pixel = &image[((size_t) y * width + x) * 4];
+			uint16_t max = 0;
+			for(unsigned int c = 0; c < 3; c++) {
+				uint16_t v[8];
+				unsigned int n = 0;
+				for(int dy = -1; dy <= 1; dy++) {
+					for(int dx = -1; dx <= 1; dx++) {
+						int nx = (int) x + dx;
+						int ny = (int) y + dy;
+						if((dx == 0 && dy == 0) || nx < 0 ||
+								ny < 0 ||
+								nx >= (int) width ||
+								ny >= (int) height) {
+							continue;
+						}
+						v[n++] = image[((size_t) ny * width + nx) * 4 + c];
+					}
+				}
+
+				if(n == 0) {
+					continue;
+				}
+
+				std::nth_element(v, v + (n - 1) / 2, v + n);
+				int d = (int) pixel[c] - v[(n - 1) / 2];
+				uint16_t ad = d < 0 ? -d : d;
+				if(ad > max) {
+					max = ad;
+				}
+			}
+
+			deviation[(size_t) y * width + x] = max;
+			histogram[max]++;
+		}
+	}
+
+	// median absolute deviation as noise estimate
+	size_t half = (size_t) width * height / 2;
+	size_t count = 0;
+	unsigned int mad = 0;
+	for(; mad < 65535; mad++) {
+		count += histogram[mad];
+		if(count > half) {
+			break;
+		}
+	}
+
+	float threshold = sigma * 1.4826f * mad;
+	if(threshold < 1) {
+		threshold = 1;
+	}
+
+	for(unsigned int y = 0; y < height; y++) {
+		for(unsigned int x = 0; x < width; x++) {
+			if(deviation[(size_t) y * width + x] > threshold) {
+				points.push_back(x);
+				points.push_back(y);
+			}
+		}
+	}
+}
+
+bool DefectMap::load(const char* filename)
+{
+	FILE* f = fopen(filename, "rt");
+	if(!f) {
+		printf("Error opening %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+
+	char magic[32];
+	if(!fgets(magic, sizeof(magic), f) ||
+			strncmp(magic, DEFECTS_MAGIC, strlen(DEFECTS_MAGIC)) ||
+			fscanf(f, "%u %u", &width, &height) != 2) {
+		printf("%s is not a defect map\n", filename);
+		fclose(f);
+		return false;
+	}
+
+	points.clear();
+
+	unsigned int x;
+	unsigned int y;
+	while(fscanf(f, "%u %u", &x, &y) == 2) {
+		if(x >= width || y >= height) {
+			printf("Defect %u,%u is outside of the frame\n", x, y);
+			fclose(f);
+			return false;
+		}
+		points.push_back(x);
+		points.push_back(y);
+	}
+
+	fclose(f);
+
+	return true;
+}
+
+std::string DefectMap::format()
+{
+	std::string text = DEFECTS_MAGIC "\n";
+
+	char line[32];
+	snprintf(line, sizeof(line), "%u %u\n", width, height);
+	text += line;
+
+	for(size_t i = 0; i < points.size(); i += 2) {
+		snprintf(line, sizeof(line), "%u %u\n", points[i],
+				points[i + 1]);
+		text += line;
+	}
+
+	return text;
+}
+
+// Maps the defects to a frame decoded at width x height (the map may have
+// been made at a different resolution scale) and to a crop of it. Returns
+// x/y pairs; several defects may map to the same pixel.
+std::vector<unsigned int> DefectMap::transform(unsigned int width,
+		unsigned int height, unsigned int offset_x,
+		unsigned int offset_y, unsigned int crop_width,
+		unsigned int crop_height)
+{
+	std::vector<unsigned int> result;
+	for(size_t i = 0; i < points.size(); i += 2) {
+		unsigned int x = (uint64_t) points[i] * width / this->width;
+		unsigned int y = (uint64_t) points[i + 1] * height / this->height;
+		if(x < offset_x || y < offset_y || x >= offset_x + crop_width ||
+				y >= offset_y + crop_height) {
+			continue;
+		}
+		result.push_back(x - offset_x);
+		result.push_back(y - offset_y);
+	}
+
+	return result;
+}
+
+// The map fits a frame of the same aspect ratio, e.g. the same sensor decoded
+// at a different resolution scale.
+bool DefectMap::matches(unsigned int width, unsigned int height)
+{
+	return (uint64_t) this->width * height == (uint64_t) width * this->height;
+}
+
+unsigned int DefectMap::get_count()
+{
+	return points.size() / 2;
+}
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
 #include <GL/gl.h>
 #include <EGL/egl.h>
 
@@ -15,20 +16,37 @@ static const EGLint configAttribs[] = {
 	EGL_NONE
 };
 
-EGL::EGL()
+// The display is shared by all contexts of the process and only terminated
+// with the last one.
+static std::mutex display_lock;
+static unsigned int display_users = 0;
+
+EGL::EGL(EGL* share) : locked(false)
 {
-	if(!init()) {
+	if(share != nullptr) {
+		group_lock = share->group_lock;
+	} else {
+		group_lock = std::make_shared<std::mutex>();
+	}
+
+	if(!init(share)) {
 		exit(1);
 	}
 }
 
 EGL::~EGL()
 {
+	unbind();
+	eglDestroyContext(display, context);
+
 	// Terminate EGL when finished
-	eglTerminate(display);
+	std::lock_guard<std::mutex> guard(display_lock);
+	if(--display_users == 0) {
+		eglTerminate(display);
+	}
 }
 
-bool EGL::init()
+bool EGL::init(EGL* share)
 {
 	// Initialize EGL
 	display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
@@ -37,7 +55,11 @@ bool EGL::init()
 		return false;
 	}
 
-	eglInitialize(display, &major, &minor);
+	{
+		std::lock_guard<std::mutex> guard(display_lock);
+		eglInitialize(display, &major, &minor);
+		display_users++;
+	}
 
 	if(error()) {
 		return false;
@@ -60,8 +82,15 @@ bool EGL::init()
 		return false;
 	}
 
-	// Create a context and make it current
-	context = eglCreateContext(display, eglCfg, EGL_NO_CONTEXT, NULL);
+	// Create a context, in the group of share if given
+	if(share != nullptr) {
+		std::lock_guard<std::mutex> guard(*group_lock);
+		context = eglCreateContext(display, eglCfg, share->context,
+				NULL);
+	} else {
+		context = eglCreateContext(display, eglCfg, EGL_NO_CONTEXT,
+				NULL);
+	}
 
 	if(error()) {
 		return false;
@@ -72,6 +101,11 @@ bool EGL::init()
 
 bool EGL::make_current()
 {
+	if(!locked) {
+		group_lock->lock();
+		locked = true;
+	}
+
 	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
 
 	return !error();
@@ -81,6 +115,11 @@ void EGL::unbind()
 {
 	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	error();
+
+	if(locked) {
+		locked = false;
+		group_lock->unlock();
+	}
 }
 
 const char* EGL::error_msg(EGLint err)
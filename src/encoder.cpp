@@ -0,0 +1,481 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#include <zlib.h>
+
+#include "encoder.h"
+
+// rows per TIFF strip and lines per EXR ZIP block
+#define	TIFF_STRIP_ROWS		32
+#define	EXR_ZIP_LINES		16
+
+#define	TIFF_SHORT		3
+#define	TIFF_LONG		4
+
+#define	EXR_NO_COMPRESSION	0
+#define	EXR_ZIP_COMPRESSION	3
+#define	EXR_HALF		1
+
+static void put_le16(std::vector<uint8_t>& out, uint16_t value)
+{
+	out.push_back(value & 0xFF);
+	out.push_back(value >> 8);
+}
+
+static void put_le32(std::vector<uint8_t>& out, uint32_t value)
+{
+	put_le16(out, value & 0xFFFF);
+	put_le16(out, value >> 16);
+}
+
+static void put_be32(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back(value >> 24);
+	out.push_back((value >> 16) & 0xFF);
+	out.push_back((value >> 8) & 0xFF);
+	out.push_back(value & 0xFF);
+}
+
+static void set_le32(std::vector<uint8_t>& out, size_t pos, uint32_t value)
+{
+	for(int i = 0; i < 4; i++) {
+		out[pos + i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+static void set_le64(std::vector<uint8_t>& out, size_t pos, uint64_t value)
+{
+	for(int i = 0; i < 8; i++) {
+		out[pos + i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+// Appends the zlib stream of size bytes of data to out.
+static void deflate_append(std::vector<uint8_t>& out, const void* data,
+		size_t size, int level)
+{
+	size_t pos = out.size();
+	uLongf length = compressBound(size);
+	out.resize(pos + length);
+
+	if(compress2(out.data() + pos, &length, (const Bytef*) data, size,
+				level) != Z_OK) {
+		printf("Deflate error\n");
+		exit(1);
+	}
+
+	out.resize(pos + length);
+}
+
+static void tiff_entry(std::vector<uint8_t>& out, uint16_t tag, uint16_t type,
+		uint32_t count, uint32_t value)
+{
+	put_le16(out, tag);
+	put_le16(out, type);
+	put_le32(out, count);
+	if(type == TIFF_SHORT && count == 1) {
+		put_le16(out, value);
+		put_le16(out, 0);
+	} else {
+		put_le32(out, value);
+	}
+}
+
+// Little endian RGB TIFF in strips of TIFF_STRIP_ROWS rows; compressed strips
+// use the horizontal predictor.
+std::vector<uint8_t> encode_tiff(const uint16_t* image, unsigned int width,
+		unsigned int height, int level)
+{
+	std::vector<uint8_t> out;
+	unsigned int strips = (height + TIFF_STRIP_ROWS - 1) / TIFF_STRIP_ROWS;
+	std::vector<uint32_t> offsets(strips);
+	std::vector<uint32_t> counts(strips);
+
+	out.reserve((size_t) width * height * 6 + 1024);
+	out.push_back('I');
+	out.push_back('I');
+	put_le16(out, 42);
+	put_le32(out, 0);
+
+	std::vector<uint16_t> strip((size_t) width * TIFF_STRIP_ROWS * 3);
+	for(unsigned int i = 0; i < strips; i++) {
+		unsigned int y = i * TIFF_STRIP_ROWS;
+		unsigned int rows = height - y < TIFF_STRIP_ROWS ?
+			height - y : TIFF_STRIP_ROWS;
+
+		for(unsigned int row = 0; row < rows; row++) {
+			const uint16_t* src = image + (size_t) (y + row) * width * 4;
+			uint16_t* dst = strip.data() + (size_t) row * width * 3;
+			for(unsigned int x = 0; x < width; x++) {
+				dst[3 * x + 0] = src[4 * x + 0];
+				dst[3 * x + 1] = src[4 * x + 1];
+				dst[3 * x + 2] = src[4 * x + 2];
+			}
+
+			if(level > 0) {
+				for(unsigned int x = width - 1; x > 0; x--) {
+					dst[3 * x + 0] -= dst[3 * x - 3];
+					dst[3 * x + 1] -= dst[3 * x - 2];
+					dst[3 * x + 2] -= dst[3 * x - 1];
+				}
+			}
+		}
+
+		size_t size = (size_t) rows * width * 3 * sizeof(uint16_t);
+		offsets[i] = out.size();
+		if(level > 0) {
+			deflate_append(out, strip.data(), size, level);
+		} else {
+			const uint8_t* data = (const uint8_t*) strip.data();
+			out.insert(out.end(), data, data + size);
+		}
+		counts[i] = out.size() - offsets[i];
+	}
+
+	if(out.size() & 1) {
+		out.push_back(0);
+	}
+
+	uint32_t bits = out.size();
+	for(int i = 0; i < 3; i++) {
+		put_le16(out, 16);
+	}
+
+	// a single strip is stored in the directory entry itself
+	uint32_t strip_offsets = offsets[0];
+	uint32_t strip_counts = counts[0];
+	if(strips > 1) {
+		strip_offsets = out.size();
+		for(uint32_t offset : offsets) {
+			put_le32(out, offset);
+		}
+		strip_counts = out.size();
+		for(uint32_t count : counts) {
+			put_le32(out, count);
+		}
+	}
+
+	set_le32(out, 4, out.size());
+
+	put_le16(out, level > 0 ? 11 : 10);
+	tiff_entry(out, 256, TIFF_LONG, 1, width);
+	tiff_entry(out, 257, TIFF_LONG, 1, height);
+	tiff_entry(out, 258, TIFF_SHORT, 3, bits);
+	tiff_entry(out, 259, TIFF_SHORT, 1, level > 0 ? 8 : 1);
+	tiff_entry(out, 262, TIFF_SHORT, 1, 2);
+	tiff_entry(out, 273, TIFF_LONG, strips, strip_offsets);
+	tiff_entry(out, 277, TIFF_SHORT, 1, 3);
+	tiff_entry(out, 278, TIFF_LONG, 1, TIFF_STRIP_ROWS);
+	tiff_entry(out, 279, TIFF_LONG, strips, strip_counts);
+	tiff_entry(out, 284, TIFF_SHORT, 1, 1);
+	if(level > 0) {
+		tiff_entry(out, 317, TIFF_SHORT, 1, 2);
+	}
+	put_le32(out, 0);
+
+	return out;
+}
+
+static void png_chunk(std::vector<uint8_t>& out, const char* type,
+		const uint8_t* data, size_t size)
+{
+	put_be32(out, size);
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put_be32(out, crc32(0, out.data() + start, size + 4));
+}
+
+// 16bit RGB PNG; every row uses the sub filter, which is cheap and about as
+// good as the adaptive filters on noise free frames.
+std::vector<uint8_t> encode_png(const uint16_t* image, unsigned int width,
+		unsigned int height, int level)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+	};
+
+	size_t stride = (size_t) width * 6 + 1;
+	std::vector<uint8_t> rows(stride * height);
+
+	for(unsigned int y = 0; y < height; y++) {
+		const uint16_t* src = image + (size_t) y * width * 4;
+		uint8_t* dst = rows.data() + y * stride;
+		dst[0] = 1;
+		dst++;
+
+		for(unsigned int x = 0; x < width; x++) {
+			for(int c = 0; c < 3; c++) {
+				dst[6 * x + 2 * c] = src[4 * x + c] >> 8;
+				dst[6 * x + 2 * c + 1] = src[4 * x + c] & 0xFF;
+			}
+		}
+
+		for(size_t i = (size_t) width * 6 - 1; i >= 6; i--) {
+			dst[i] -= dst[i - 6];
+		}
+	}
+
+	std::vector<uint8_t> ihdr;
+	put_be32(ihdr, width);
+	put_be32(ihdr, height);
+	ihdr.push_back(16);	// bit depth
+	ihdr.push_back(2);	// RGB
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+
+	std::vector<uint8_t> idat;
+	deflate_append(idat, rows.data(), rows.size(), level);
+
+	std::vector<uint8_t> out;
+	out.reserve(idat.size() + 64);
+	out.insert(out.end(), signature, signature + sizeof(signature));
+	png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+	png_chunk(out, "IDAT", idat.data(), idat.size());
+	png_chunk(out, "IEND", nullptr, 0);
+
+	return out;
+}
+
+static void exr_attribute(std::vector<uint8_t>& out, const char* name,
+		const char* type, uint32_t size)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put_le32(out, size);
+}
+
+static void put_float(std::vector<uint8_t>& out, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put_le32(out, bits);
+}
+
+// Scanline EXR with half float B, G and R channels, either uncompressed or
+// with ZIP compression of 16 lines per block.
+std::vector<uint8_t> encode_exr(const uint16_t* image, unsigned int width,
+		unsigned int height, int level)
+{
+	static const char channels[3] = { 'B', 'G', 'R' };
+
+	unsigned int lines = level > 0 ? EXR_ZIP_LINES : 1;
+	unsigned int blocks = (height + lines - 1) / lines;
+
+	std::vector<uint8_t> out;
+	out.reserve((size_t) width * height * 6 + 1024);
+
+	put_le32(out, 20000630);
+	put_le32(out, 2);
+
+	exr_attribute(out, "channels", "chlist", 3 * 18 + 1);
+	for(char channel : channels) {
+		out.push_back(channel);
+		out.push_back(0);
+		put_le32(out, EXR_HALF);
+		put_le32(out, 0);	// pLinear and reserved
+		put_le32(out, 1);
+		put_le32(out, 1);
+	}
+	out.push_back(0);
+
+	exr_attribute(out, "compression", "compression", 1);
+	out.push_back(level > 0 ? EXR_ZIP_COMPRESSION : EXR_NO_COMPRESSION);
+
+	for(const char* window : { "dataWindow", "displayWindow" }) {
+		exr_attribute(out, window, "box2i", 16);
+		put_le32(out, 0);
+		put_le32(out, 0);
+		put_le32(out, width - 1);
+		put_le32(out, height - 1);
+	}
+
+	exr_attribute(out, "lineOrder", "lineOrder", 1);
+	out.push_back(0);	// increasing y
+
+	exr_attribute(out, "pixelAspectRatio", "float", 4);
+	put_float(out, 1.0f);
+
+	exr_attribute(out, "screenWindowCenter", "v2f", 8);
+	put_float(out, 0.0f);
+	put_float(out, 0.0f);
+
+	exr_attribute(out, "screenWindowWidth", "float", 4);
+	put_float(out, 1.0f);
+
+	out.push_back(0);
+
+	size_t table = out.size();
+	out.resize(table + (size_t) blocks * 8);
+
+	std::vector<uint8_t> block((size_t) width * lines * 6);
+	std::vector<uint8_t> shuffled(block.size());
+	for(unsigned int i = 0; i < blocks; i++) {
+		unsigned int y = i * lines;
+		unsigned int count = height - y < lines ? height - y : lines;
+
+		// every line holds the channels one after another
+		uint8_t* dst = block.data();
+		for(unsigned int line = 0; line < count; line++) {
+			const uint16_t* src = image + (size_t) (y + line) * width * 4;
+			for(int c = 2; c >= 0; c--) {
+				for(unsigned int x = 0; x < width; x++) {
+					uint16_t value = src[4 * x + c];
+					*dst++ = value & 0xFF;
+					*dst++ = value >> 8;
+				}
+			}
+		}
+		size_t size = dst - block.data();
+
+		set_le64(out, table + (size_t) i * 8, out.size());
+		put_le32(out, y);
+
+		if(level > 0) {
+			// ZIP splits even and odd bytes and deflates the deltas
+			uint8_t* even = shuffled.data();
+			uint8_t* odd = shuffled.data() + (size + 1) / 2;
+			for(size_t j = 0; j < size; j += 2) {
+				*even++ = block[j];
+				*odd++ = block[j + 1];
+			}
+
+			int prev = shuffled[0];
+			for(size_t j = 1; j < size; j++) {
+				int value = shuffled[j];
+				shuffled[j] = (uint8_t) (value - prev + 128 + 256);
+				prev = value;
+			}
+
+			size_t pos = out.size();
+			put_le32(out, 0);
+			deflate_append(out, shuffled.data(), size, level);
+
+			size_t compressed = out.size() - pos - 4;
+			if(compressed >= size) {
+				// stored uncompressed if deflate does not help
+				out.resize(pos + 4);
+				out.insert(out.end(), block.data(),
+						block.data() + size);
+				compressed = size;
+			}
+			set_le32(out, pos, compressed);
+		} else {
+			put_le32(out, size);
+			out.insert(out.end(), block.data(), block.data() + size);
+		}
+	}
+
+	return out;
+}
+
+const char* format_extension(ImageFormat format)
+{
+	switch(format) {
+		case FORMAT_TIFF:
+			return "tif";
+		case FORMAT_PNG:
+			return "png";
+		case FORMAT_EXR:
+			return "exr";
+		default:
+			return "jpg";
+	}
+}
+
+EncoderPool::EncoderPool(unsigned int count)
+	: busy(0), done(false), stalls(0)
+{
+	for(unsigned int i = 0; i < count; i++) {
+		threads.push_back(std::thread(&EncoderPool::run, this));
+	}
+}
+
+EncoderPool::~EncoderPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void EncoderPool::submit(const std::function<void()>& job)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	if(queue.size() >= 2 * threads.size()) {
+		stalls++;
+	}
+	cv.wait(guard, [this] {
+		return queue.size() < 2 * threads.size();
+	});
+	queue.push_back(job);
+	cv.notify_all();
+}
+
+void EncoderPool::add_thread()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	threads.push_back(std::thread(&EncoderPool::run, this));
+}
+
+unsigned int EncoderPool::get_threads()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return threads.size();
+}
+
+unsigned long EncoderPool::get_stalls()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return stalls;
+}
+
+// Returns the number of jobs which are queued or being encoded.
+unsigned int EncoderPool::get_queued()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return queue.size() + busy;
+}
+
+// Waits until all submitted jobs are finished.
+void EncoderPool::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [this] {
+		return queue.empty() && busy == 0;
+	});
+}
+
+void EncoderPool::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while(true) {
+		cv.wait(guard, [this] {
+			return done || !queue.empty();
+		});
+		if(queue.empty()) {
+			break;
+		}
+
+		std::function<void()> job = queue.front();
+		queue.pop_front();
+		busy++;
+		cv.notify_all();
+
+		guard.unlock();
+		job();
+		guard.lock();
+
+		busy--;
+		cv.notify_all();
+	}
+}
@@ -0,0 +1,240 @@
+#include <cstdio>
+#include <deque>
+
+#include "libbrawshot.h"
+#include "brawshot.h"
+#include "bufferpool.h"
+
+struct brawshot {
+	brawshot_config_t config;
+	brawshot_output_cb_t output_cb;
+	brawshot_release_t release;
+	void*		opaque;
+
+	VideoProcessor*	processor;
+	bool		attached;	// the processor belongs to the caller
+	size_t		frame_size;
+
+	// frames in the window, oldest first, with their user data
+	std::deque<std::pair<const uint16_t*, void*>> frames;
+	unsigned long	pushed;
+
+	// output frame for the callback, if no buffer is passed in
+	BufferPool*	pool;
+	FrameBuffer	output;
+};
+
+static size_t pixel_size(brawshot_output_t output)
+{
+	return output == BRAWSHOT_OUTPUT_BGRA8 ? 4 : 4 * sizeof(uint16_t);
+}
+
+brawshot_t* brawshot_create(const brawshot_config_t* config,
+		brawshot_output_cb_t output, brawshot_release_t release,
+		void* opaque)
+{
+	if(config->width == 0 || config->height == 0 || config->window == 0 ||
+			(config->stride != 0 &&
+			 config->stride < config->width) ||
+			config->input_bits > 16) {
+		printf("Invalid filter configuration\n");
+		return nullptr;
+	}
+
+	bool deep = config->output == BRAWSHOT_OUTPUT_GRADED16 ||
+		config->output == BRAWSHOT_OUTPUT_HALF;
+	unsigned int ring = config->robust ? config->window : 0;
+	unsigned int input_bits = config->input_bits ? config->input_bits : 16;
+
+	unsigned int tile_height = 0;
+	if(config->vram_budget) {
+		tile_height = VideoProcessor::tile_height_for_budget(
+				config->width, config->height,
+				config->vram_budget, false, ring, deep,
+				VideoProcessor::narrow_accumulator(
+					config->window, input_bits, ring));
+		if(tile_height == 0) {
+			printf("A %ux%u frame does not fit into the VRAM budget\n",
+					config->width, config->height);
+			return nullptr;
+		}
+	}
+
+	brawshot_t* filter = new brawshot_t;
+	filter->config = *config;
+	filter->output_cb = output;
+	filter->release = release;
+	filter->opaque = opaque;
+	filter->pushed = 0;
+	filter->attached = false;
+
+	filter->processor = new VideoProcessor(config->width, config->height,
+			config->gain, config->lut_filename, tile_height);
+	if(deep) {
+		filter->processor->set_deep_output(config->output ==
+				BRAWSHOT_OUTPUT_HALF);
+	}
+	if(config->stride) {
+		filter->processor->set_input_stride(config->stride);
+	}
+
+	if(!filter->processor->set_robust(ring,
+				config->robust == BRAWSHOT_ROBUST_MEDIAN,
+				config->kappa)) {
+		delete filter->processor;
+		delete filter;
+		return nullptr;
+	}
+	filter->processor->set_window(config->window, input_bits);
+
+	filter->frame_size = (size_t) config->width * config->height *
+		pixel_size(config->output);
+	filter->pool = new BufferPool(filter->frame_size, HUGE_PAGES_OFF,
+			false);
+
+	return filter;
+}
+
+brawshot_t* brawshot_attach(VideoProcessor* processor,
+		const brawshot_config_t* config)
+{
+	brawshot_t* filter = new brawshot_t;
+	filter->config = *config;
+	filter->output_cb = nullptr;
+	filter->release = nullptr;
+	filter->opaque = nullptr;
+	filter->pushed = 0;
+	filter->processor = processor;
+	filter->attached = true;
+	filter->frame_size = (size_t) config->width * config->height *
+		pixel_size(config->output);
+	filter->pool = nullptr;
+
+	return filter;
+}
+
+void brawshot_destroy(brawshot_t* filter)
+{
+	if(filter == nullptr) {
+		return;
+	}
+
+	if(filter->release != nullptr) {
+		for(auto& frame : filter->frames) {
+			filter->release(filter->opaque, frame.second);
+		}
+	}
+
+	if(!filter->attached) {
+		delete filter->processor;
+	}
+
+	// the buffer has to return to its pool first
+	filter->output.reset();
+	delete filter->pool;
+
+	delete filter;
+}
+
+void brawshot_load_reference(brawshot_t* filter, const uint16_t* image,
+		int after_lut)
+{
+	brawshot_load_reference_mean(filter, image, after_lut, nullptr);
+}
+
+void brawshot_load_reference_mean(brawshot_t* filter, const uint16_t* image,
+		int after_lut, const unsigned int* mean)
+{
+	filter->processor->load_reference((uint16_t*) image, after_lut != 0,
+			mean);
+}
+
+int brawshot_add(brawshot_t* filter, const uint16_t* frame)
+{
+	filter->processor->add((uint16_t*) frame);
+	return filter->processor->get_samples() >= filter->config.window;
+}
+
+void brawshot_subtract(brawshot_t* filter, const uint16_t* frame)
+{
+	// the ring of the robust stack drops old frames by itself
+	filter->processor->subtract((uint16_t*) frame);
+}
+
+void brawshot_read(brawshot_t* filter, void* output)
+{
+	VideoProcessor* processor = filter->processor;
+
+	switch(filter->config.output) {
+		case BRAWSHOT_OUTPUT_BGRA8:
+			processor->output((uint8_t*) output);
+			break;
+		case BRAWSHOT_OUTPUT_RAW16:
+			processor->output_raw((uint16_t*) output);
+			break;
+		default:
+			processor->output_deep((uint16_t*) output,
+					filter->config.output ==
+					BRAWSHOT_OUTPUT_HALF);
+			break;
+	}
+}
+
+int brawshot_push(brawshot_t* filter, const uint16_t* frame, void* frame_data,
+		void* output)
+{
+	// the ring of the robust stack drops old frames by itself
+	if(!filter->config.robust &&
+			filter->frames.size() == filter->config.window) {
+		std::pair<const uint16_t*, void*> oldest =
+			filter->frames.front();
+		filter->frames.pop_front();
+
+		brawshot_subtract(filter, oldest.first);
+		if(filter->release != nullptr) {
+			filter->release(filter->opaque, oldest.second);
+		}
+	}
+
+	bool full = brawshot_add(filter, frame) != 0;
+	filter->pushed++;
+
+	if(filter->config.robust) {
+		if(filter->release != nullptr) {
+			filter->release(filter->opaque, frame_data);
+		}
+	} else {
+		filter->frames.push_back(std::make_pair(frame, frame_data));
+	}
+
+	if(!full) {
+		return 0;
+	}
+
+	void* image = output;
+	if(image == nullptr) {
+		if(filter->output.get<void>() == nullptr) {
+			filter->output = filter->pool->acquire();
+		}
+		image = filter->output.get<void>();
+	}
+
+	brawshot_read(filter, image);
+
+	if(output == nullptr && filter->output_cb != nullptr) {
+		filter->output_cb(filter->opaque, image,
+				filter->pushed - filter->config.window);
+	}
+
+	return 1;
+}
+
+size_t brawshot_frame_size(const brawshot_t* filter)
+{
+	return filter->frame_size;
+}
+
+void brawshot_set_gain(brawshot_t* filter, float gain)
+{
+	filter->processor->set_gain(gain);
+}
@@ -8,10 +8,36 @@
 #include <chrono>
 #include <atomic>
 #include <thread>
+#include <cerrno>
+#include <csignal>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 #include <turbojpeg.h>
 
 #include "brawshot.h"
+#include "libbrawshot.h"
+#include "checkpoint.h"
+#include "stack.h"
+#include "reference.h"
+#include "defects.h"
+#include "autogain.h"
+#include "stream.h"
+#include "matroska.h"
+#include "encoder.h"
+#include "writer.h"
+#include "bufferpool.h"
+#include "resources.h"
+#include "autotune.h"
+#include "metrics.h"
+#include "verify.h"
 
 #ifdef DEBUG
 	#include <cassert>
@@ -28,67 +54,987 @@ static const BlackmagicRawResourceFormat s_resourceFormat = blackmagicRawResourc
 static const char* outputFileName = "output";
 static const char* ref_filename = nullptr;
 
-static const int s_maxJobsInFlight = 1;
-static std::atomic<int> jobsInFlight = {0};
+// decode jobs in flight, either fixed or chosen by the autotuner
+static unsigned int decode_jobs = 1;
+static bool autotune = false;
+static size_t tune_memory = 0;
+static const char* profile_filename = nullptr;
+static Autotuner* autotuner = nullptr;
 
-static tjhandle tjinst = nullptr;
+// one compressor per thread, as several frames may be encoded at once
+static thread_local tjhandle tjinst = nullptr;
 
 static bool single = false;
 static bool raw_dump = false;
 static bool ref_after_lut = false;
 
-void output_image(unsigned int width, unsigned int height, uint8_t* image,
-		unsigned long index)
+static unsigned long checkpoint_interval = 0;
+static bool resume = false;
+
+static unsigned int shard_index = 0;
+static unsigned int shard_count = 0;
+
+struct BatchJob {
+	std::string	clip;
+	std::string	output;
+	const char*	state;
+	float		progress;
+
+	BatchJob(const std::string& clip, const std::string& output)
+			: clip(clip), output(output), state("queued"),
+			progress(0) {}
+};
+
+static size_t vram_budget = 0;
+
+// significant bits of the decoded frames; with fewer bits, more frames fit
+// into the 16bit accumulator
+static unsigned int input_bits = 16;
+
+static unsigned long output_every = 0;
+static std::set<unsigned long> output_at;
+
+// Previews only decode every sample_stride-th frame, optionally at a reduced
+// resolution
+static unsigned int sample_stride = 1;
+static unsigned int scale_factor = 1;
+static BlackmagicRawResolutionScale resolution_scale = blackmagicRawResolutionScaleFull;
+
+static bool build_dark = false;
+
+// the output frames are read back into reusable buffers
+static HugePages huge_pages = HUGE_PAGES_OFF;
+static bool lock_buffers = false;
+static bool sdk_buffers = false;
+
+// the output frames are written in the background
+static FileWriter* writer = nullptr;
+static bool use_uring = true;
+static unsigned int io_threads = 4;
+static FsyncPolicy fsync_policy = FSYNC_NONE;
+static bool direct_io = false;
+
+// 16bit graded output formats are encoded on a pool of threads
+static ImageFormat output_format = FORMAT_JPEG;
+static int compression_level = 1;
+static unsigned int encoder_threads = 0;
+static EncoderPool* encoders = nullptr;
+
+// Additional outputs of every output frame (--output-spec), rendered from the
+// same accumulator as the main output with their own gain, LUT and format.
+struct OutputSpec {
+	std::string	prefix;
+	ImageFormat	format;
+	bool		raw;		// RAW dump instead of format
+	bool		graded;
+	float		gain;		// 0 for the gain of the run
+	std::string	lut_filename;	// empty for the LUT of the run
+	bool		no_lut;
+	unsigned int	scale;
+
+	// LUT index in the processor, -1 for none
+	int		lut;
+};
+
+static std::vector<OutputSpec> output_specs;
+static int main_lut = -1;
+
+static bool mkv = false;
+static MatroskaWriter* container = nullptr;
+
+static int stream_fd = -1;
+static StreamFormat stream_format = STREAM_Y4M;
+static StreamWriter* stream = nullptr;
+
+static AutoGain* auto_gain = nullptr;
+static float gain_percentile = 99.0f;
+static float gain_target = 0.9f;
+static const char* stats_filename = nullptr;
+static FILE* stats_file = nullptr;
+
+static bool find_defects = false;
+
+static bool verify = false;
+static const char* verify_baseline = nullptr;
+static float verify_threshold = 20.0f;
+static float defect_sigma = 10.0f;
+static const char* defects_filename = nullptr;
+static DefectMap* defect_map = nullptr;
+
+static bool robust = false;
+static bool robust_median = false;
+static float robust_kappa = 3.0f;
+
+static bool stack_mode = false;
+static unsigned int stack_jobs = 4;
+
+static bool crop = false;
+static unsigned int crop_x = 0;
+static unsigned int crop_y = 0;
+static unsigned int crop_width = 0;
+static unsigned int crop_height = 0;
+
+static const char* batch_filename = nullptr;
+static const char* watch_dir = nullptr;
+static const char* status_filename = nullptr;
+
+static Metrics metrics;
+static const char* metrics_filename = nullptr;
+static const char* metrics_socket = nullptr;
+static unsigned int metrics_interval = 10;
+static MetricsExporter* exporter = nullptr;
+static std::vector<BatchJob> batch_jobs;
+
+// guards batch_jobs and the status file when clips run concurrently
+static std::mutex status_lock;
+
+// batch clips processed at the same time, each with its own processor
+static unsigned int concurrent_clips = 1;
+
+// the processors of concurrent clips share the shaders and LUTs of the first
+static VideoProcessor* processor_group = nullptr;
+static std::mutex processor_lock;
+
+struct UserData;
+
+// A decoded frame waiting for its turn on the GPU. processedImage is null if
+// the frame could not be decoded.
+struct PendingFrame {
+	UserData*	userData;
+	IBlackmagicRawProcessedImage* processedImage;
+	uint16_t*	image;
+	unsigned int	width;
+	unsigned int	height;
+};
+
+// Everything which belongs to the clip being processed, so that several clips
+// can be processed at the same time.
+struct ClipState {
+	std::string	prefix;		// output file name prefix
+	int		digits;		// of the output frame numbers
+	long		job;		// batch job, -1 for none
+	unsigned int	frame_width;	// of the decoded frames
+	unsigned int	frame_height;
+
+	// drives the processor through the window of the clip
+	brawshot_t*	filter;
+
+	std::atomic<int> jobs_in_flight;
+
+	// output frames which are not written yet
+	std::atomic<int> outputs_pending;
+
+	// frames of this clip in the metrics
+	uint64_t	frames;
+	std::atomic<uint64_t> frames_done;
+	size_t		gpu_memory;
+
+	// With several decode jobs in flight, frames complete in any order
+	// but have to be applied in the order they were submitted. Whichever
+	// thread completes the next frame applies it and all frames queued
+	// after it.
+	std::mutex	apply_lock;
+	std::map<unsigned long, PendingFrame> apply_queue;
+	unsigned long	apply_next;
+	bool		applying;
+
+	// the output frames are read back into reusable buffers, with one
+	// pool per output spec
+	BufferPool*	frame_pool;
+	std::vector<BufferPool*> spec_pools;
+
+	ClipState(const char* prefix, long job)
+			: prefix(prefix), digits(4), job(job), frame_width(0),
+			frame_height(0), filter(nullptr), jobs_in_flight(0),
+			outputs_pending(0), frames(0), frames_done(0),
+			gpu_memory(0), apply_next(0), applying(false),
+			frame_pool(nullptr) {}
+};
+
+// the clips in progress, for the metrics
+static std::set<ClipState*> active_clips;
+static std::mutex clips_lock;
+
+static void get_filename(char* filename, const char* prefix, int digits,
+		const char* ext, unsigned long index)
 {
-	char filename[256];
 	if(single) {
-		strcpy(filename, outputFileName);
+		strcpy(filename, prefix);
+	} else {
+		sprintf(filename, "%s-%0*lu.%s", prefix, digits, index, ext);
+	}
+}
+
+static void get_filename(const ClipState* clip, char* filename,
+		const char* ext, unsigned long index)
+{
+	get_filename(filename, clip->prefix.c_str(), clip->digits, ext, index);
+}
+
+// Files are written under a temporary name and renamed when complete, so an
+// interrupted run never leaves a truncated output behind.
+static void write_file(const char* filename, const void* data, size_t size)
+{
+	char tmpname[256];
+	snprintf(tmpname, sizeof(tmpname), "%s.part", filename);
+
+	FILE* f = fopen(tmpname, "wb");
+	if(!f) {
+		printf("Error creating %s: %s\n", tmpname, strerror(errno));
+		exit(1);
+	}
+	fwrite(data, size, 1, f);
+	fclose(f);
+
+	if(rename(tmpname, filename) != 0) {
+		printf("Error renaming %s: %s\n", tmpname, strerror(errno));
+		exit(1);
+	}
+}
+
+static void WriteStatus()
+{
+	if(status_filename == nullptr) {
+		return;
+	}
+
+	std::string status;
+	for(const BatchJob& job : batch_jobs) {
+		char line[64];
+		snprintf(line, sizeof(line), "%-8s %5.1f%% ", job.state,
+				job.progress);
+		status += line + job.clip + " " + job.output + "\n";
+	}
+
+	write_file(status_filename, status.data(), status.size());
+}
+
+static void ReportProgress(const ClipState* clip, float percent)
+{
+	static std::chrono::steady_clock::time_point last;
+
+	if(clip->job < 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(status_lock);
+	batch_jobs[clip->job].progress = percent;
+
+	auto now = std::chrono::steady_clock::now();
+	if(now - last >= std::chrono::seconds(1)) {
+		last = now;
+		WriteStatus();
+	}
+}
+
+// Only the selected frames run through the output shader, readback and
+// encoder; all frames are accumulated regardless.
+static bool keep_output(unsigned long index)
+{
+	if(single || output_at.count(index)) {
+		return true;
+	} else if(output_every) {
+		return index % output_every == 0;
 	} else {
-		sprintf(filename, "%s-%04lu.jpg", outputFileName, index);
+		return output_at.empty();
+	}
+}
+
+static bool parse_output_list(const char* list)
+{
+	while(*list) {
+		char* end;
+		unsigned long first = strtoul(list, &end, 10);
+		unsigned long last = first;
+		if(end == list) {
+			return false;
+		}
+		if(*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if(end == list || last < first) {
+				return false;
+			}
+		}
+		for(unsigned long i = first; i <= last; i++) {
+			output_at.insert(i);
+		}
+		if(*end == ',') {
+			end++;
+		} else if(*end) {
+			return false;
+		}
+		list = end;
+	}
+
+	return true;
+}
+
+// Parses an --output-spec of comma separated key=value pairs, e.g.
+// "format=tiff,prefix=master,lut=none,gain=1".
+static bool parse_output_spec(const char* text, OutputSpec* spec)
+{
+	spec->format = FORMAT_JPEG;
+	spec->raw = false;
+	spec->graded = true;
+	spec->gain = 0;
+	spec->no_lut = false;
+	spec->scale = 1;
+	spec->lut = -1;
+
+	std::string list = text;
+	size_t pos = 0;
+	while(pos <= list.size()) {
+		size_t end = list.find(',', pos);
+		if(end == std::string::npos) {
+			end = list.size();
+		}
+		std::string item = list.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t eq = item.find('=');
+		if(eq == std::string::npos) {
+			return false;
+		}
+		std::string key = item.substr(0, eq);
+		std::string value = item.substr(eq + 1);
+		if(value.empty()) {
+			return false;
+		}
+
+		if(key == "format") {
+			if(value == "jpg") {
+				spec->format = FORMAT_JPEG;
+			} else if(value == "tiff") {
+				spec->format = FORMAT_TIFF;
+			} else if(value == "png") {
+				spec->format = FORMAT_PNG;
+			} else if(value == "exr") {
+				spec->format = FORMAT_EXR;
+			} else if(value == "raw") {
+				spec->raw = true;
+			} else {
+				return false;
+			}
+		} else if(key == "prefix") {
+			spec->prefix = value;
+		} else if(key == "gain") {
+			spec->gain = (float) atof(value.c_str());
+			if(spec->gain <= 0) {
+				return false;
+			}
+		} else if(key == "lut") {
+			spec->no_lut = value == "none";
+			if(!spec->no_lut) {
+				spec->lut_filename = value;
+			}
+		} else if(key == "grade") {
+			if(value == "on") {
+				spec->graded = true;
+			} else if(value == "off") {
+				spec->graded = false;
+			} else {
+				return false;
+			}
+		} else if(key == "scale") {
+			spec->scale = (unsigned int) atoi(value.c_str());
+			if(spec->scale != 1 && spec->scale != 2 &&
+					spec->scale != 4) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	}
+
+	// the ungraded mean is 16bit RGBA, which only TIFF and PNG store as is;
+	// EXR gets half floats from the GPU, which are not box filtered
+	if(spec->prefix.empty() ||
+			(!spec->graded && !spec->raw &&
+			 spec->format != FORMAT_TIFF &&
+			 spec->format != FORMAT_PNG) ||
+			(spec->scale > 1 && !spec->raw &&
+			 spec->format == FORMAT_EXR)) {
+		return false;
+	}
+
+	return true;
+}
+
+// Checks whether an output file of an earlier run is complete: raw_size is the
+// size of a RAW file, or 0.
+static bool file_complete(const char* filename, bool jpeg, size_t raw_size)
+{
+	struct stat st;
+	if(stat(filename, &st) != 0) {
+		return false;
+	}
+
+	if(raw_size) {
+		return (size_t) st.st_size == raw_size;
+	} else if(!jpeg) {
+		// only written by renaming the complete file
+		return true;
+	}
+
+	// a complete JPEG file ends with an EOI marker
+	uint8_t eoi[2] = { 0 };
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		return false;
+	}
+	if(fseek(f, -2, SEEK_END) == 0) {
+		fread(eoi, 1, 2, f);
+	}
+	fclose(f);
+
+	return eoi[0] == 0xFF && eoi[1] == 0xD9;
+}
+
+static const char* spec_extension(const OutputSpec& spec)
+{
+	return spec.raw ? "raw" : format_extension(spec.format);
+}
+
+static bool output_complete(const ClipState* clip, unsigned int width,
+		unsigned int height, unsigned long index)
+{
+	char filename[256];
+	get_filename(clip, filename, raw_dump ? "raw" :
+			format_extension(output_format), index);
+
+	if(!file_complete(filename, output_format == FORMAT_JPEG, raw_dump ?
+				width * height * sizeof(uint16_t) * 4 : 0)) {
+		return false;
+	}
+
+	for(const OutputSpec& spec : output_specs) {
+		get_filename(filename, spec.prefix.c_str(), clip->digits,
+				spec_extension(spec), index);
+		size_t raw_size = (size_t) (width / spec.scale) *
+			(height / spec.scale) * sizeof(uint16_t) * 4;
+		if(!file_complete(filename, !spec.raw &&
+					spec.format == FORMAT_JPEG,
+					spec.raw ? raw_size : 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Streams the frame with the stream writer, if any.
+static void stream_image(FrameBuffer image, unsigned long index)
+{
+	if(!stream->push(std::move(image), index)) {
+		printf("The stream was closed\n");
+		exit(1);
+	}
+	Metrics::add(metrics.written);
+}
+
+// Called once an output frame of the clip is written (or streamed).
+static void output_done(ClipState* clip)
+{
+	--clip->outputs_pending;
+}
+
+// Writes (or streams) an output frame.
+void output_image(ClipState* clip, unsigned int width, unsigned int height,
+		FrameBuffer image, unsigned long index)
+{
+	if(stream != nullptr) {
+		stream_image(std::move(image), index);
+		return;
 	}
 
+	char filename[256];
+	get_filename(clip, filename, "jpg", index);
+
 	unsigned char* jpeg_buf = NULL;
 	unsigned long jpeg_size = 0;
 
-	if(tjCompress2(tjinst, image, width, 0, height, TJPF_BGRX, &jpeg_buf,
+	if(tjinst == nullptr) {
+		tjinst = tjInitCompress();
+	}
+
+	if(tjCompress2(tjinst, image.get<uint8_t>(), width, 0, height,
+				TJPF_BGRX, &jpeg_buf,
 				&jpeg_size, JPEG_SUBSAMP, JPEG_QUALITY,
 				JPEG_FLAGS) < 0) {
 		printf("compression error\n");
 		exit(1);
-	} else {
-		FILE* f = fopen(filename, "wb");
-		fwrite(jpeg_buf, jpeg_size, 1, f);
-		fclose(f);
+	}
+
+	Metrics::add(metrics.encoded);
+
+	if(container != nullptr) {
+		container->write(jpeg_buf, jpeg_size, index);
 		tjFree(jpeg_buf);
+		Metrics::add(metrics.written);
+		Metrics::add(metrics.bytes_written, jpeg_size);
+	} else {
+		++clip->outputs_pending;
+		writer->write(filename, jpeg_buf, jpeg_size, [=] {
+			tjFree(jpeg_buf);
+			output_done(clip);
+		});
+	}
+}
+
+// Writes (or streams) a RAW output frame.
+void output_raw(ClipState* clip, unsigned int width, unsigned int height,
+		FrameBuffer image, unsigned long index)
+{
+	if(stream != nullptr) {
+		stream_image(std::move(image), index);
+		return;
+	}
+
+	char filename[256];
+	get_filename(clip, filename, "raw", index);
+
+	// RAW frames are written as they are
+	Metrics::add(metrics.encoded);
+
+	// the writer returns the buffer to the pool once it is written
+	FrameBuffer* buffer = new FrameBuffer(std::move(image));
+	++clip->outputs_pending;
+	writer->write(filename, buffer->get<void>(),
+			width * height * sizeof(uint16_t) * 4, [=] {
+		delete buffer;
+		output_done(clip);
+	});
+}
+
+// Queues a 16bit graded output frame for encoding.
+void output_deep(ClipState* clip, unsigned int width, unsigned int height,
+		FrameBuffer image, unsigned long index)
+{
+	char filename[256];
+	get_filename(clip, filename, format_extension(output_format), index);
+	std::string name = filename;
+
+	FrameBuffer* buffer = new FrameBuffer(std::move(image));
+	++clip->outputs_pending;
+	encoders->submit([=] {
+		const uint16_t* image = buffer->get<uint16_t>();
+		std::vector<uint8_t>* data = new std::vector<uint8_t>();
+		if(output_format == FORMAT_TIFF) {
+			*data = encode_tiff(image, width, height,
+					compression_level);
+		} else if(output_format == FORMAT_PNG) {
+			*data = encode_png(image, width, height,
+					compression_level);
+		} else {
+			*data = encode_exr(image, width, height,
+					compression_level);
+		}
+		delete buffer;
+		Metrics::add(metrics.encoded);
+
+		writer->write(name.c_str(), data->data(), data->size(),
+				[=] {
+			delete data;
+			output_done(clip);
+		});
+	});
+}
+
+// Box filter for the scaled outputs of --output-spec; the rows and columns
+// which do not fill a whole box are dropped.
+template<typename T>
+static std::vector<T> downscale(const T* image, unsigned int width,
+		unsigned int height, unsigned int factor)
+{
+	unsigned int out_width = width / factor;
+	unsigned int out_height = height / factor;
+	unsigned int count = factor * factor;
+
+	std::vector<T> out((size_t) out_width * out_height * 4);
+	for(unsigned int y = 0; y < out_height; y++) {
+		for(unsigned int x = 0; x < out_width; x++) {
+			for(unsigned int c = 0; c < 4; c++) {
+				uint32_t sum = 0;
+				for(unsigned int dy = 0; dy < factor; dy++) {
+					const T* row = &image[((size_t) (y *
+							factor + dy) * width +
+							x * factor) * 4];
+					for(unsigned int dx = 0; dx < factor;
+							dx++) {
+						sum += row[dx * 4 + c];
+					}
+				}
+				out[((size_t) y * out_width + x) * 4 + c] =
+					(sum + count / 2) / count;
+			}
+		}
 	}
+
+	return out;
 }
 
-void output_raw(unsigned int width, unsigned int height, uint16_t* image,
+// Encodes and writes a frame of an additional output on the encoder pool.
+static void output_spec(ClipState* clip, const OutputSpec* spec,
+		unsigned int width, unsigned int height, FrameBuffer image,
 		unsigned long index)
 {
 	char filename[256];
-	if(single) {
-		strcpy(filename, outputFileName);
-	} else {
-		sprintf(filename, "%s-%04lu.raw", outputFileName, index);
+	get_filename(filename, spec->prefix.c_str(), clip->digits,
+			spec_extension(*spec), index);
+	std::string name = filename;
+
+	FrameBuffer* buffer = new FrameBuffer(std::move(image));
+	++clip->outputs_pending;
+	encoders->submit([=] {
+		unsigned int out_width = width / spec->scale;
+		unsigned int out_height = height / spec->scale;
+
+		if(!spec->raw && spec->format == FORMAT_JPEG) {
+			const uint8_t* pixels = buffer->get<uint8_t>();
+			std::vector<uint8_t> scaled;
+			if(spec->scale > 1) {
+				scaled = downscale(pixels, width, height,
+						spec->scale);
+				pixels = scaled.data();
+			}
+
+			if(tjinst == nullptr) {
+				tjinst = tjInitCompress();
+			}
+
+			unsigned char* jpeg_buf = NULL;
+			unsigned long jpeg_size = 0;
+			if(tjCompress2(tjinst, pixels, out_width, 0, out_height,
+						TJPF_BGRX, &jpeg_buf, &jpeg_size,
+						JPEG_SUBSAMP, JPEG_QUALITY,
+						JPEG_FLAGS) < 0) {
+				printf("compression error\n");
+				exit(1);
+			}
+			delete buffer;
+			Metrics::add(metrics.encoded);
+
+			writer->write(name.c_str(), jpeg_buf, jpeg_size,
+					[=] {
+				tjFree(jpeg_buf);
+				output_done(clip);
+			});
+			return;
+		}
+
+		const uint16_t* pixels = buffer->get<uint16_t>();
+		std::vector<uint16_t> scaled;
+		if(spec->scale > 1) {
+			scaled = downscale(pixels, width, height, spec->scale);
+			pixels = scaled.data();
+		}
+
+		std::vector<uint8_t>* data = new std::vector<uint8_t>();
+		if(spec->raw) {
+			data->assign((const uint8_t*) pixels,
+					(const uint8_t*) pixels + (size_t)
+					out_width * out_height *
+					sizeof(uint16_t) * 4);
+		} else if(spec->format == FORMAT_TIFF) {
+			*data = encode_tiff(pixels, out_width, out_height,
+					compression_level);
+		} else if(spec->format == FORMAT_PNG) {
+			*data = encode_png(pixels, out_width, out_height,
+					compression_level);
+		} else {
+			*data = encode_exr(pixels, out_width, out_height,
+					compression_level);
+		}
+		delete buffer;
+		Metrics::add(metrics.encoded);
+
+		writer->write(name.c_str(), data->data(), data->size(),
+				[=] {
+			delete data;
+			output_done(clip);
+		});
+	});
+}
+
+// Keeps the order of the output frames for the sinks which write into a single
+// file or pipe: the next frame may finish encoding first.
+static void ReserveOutput(unsigned long index)
+{
+	if(container != nullptr) {
+		container->reserve(index);
 	}
 
-	FILE* f = fopen(filename, "wb");
-	fwrite(image, width * height * sizeof(uint16_t), 4, f);
-	fclose(f);
+	if(stream != nullptr) {
+		stream->reserve(index);
+	}
+}
+
+// Measures the averaged frame on the GPU right before it is rendered, adjusts
+// the gain and logs the statistics.
+static void ApplyStatistics(VideoProcessor* processor, unsigned long index)
+{
+	if(auto_gain == nullptr && stats_file == nullptr) {
+		return;
+	}
+
+	float bins[HISTOGRAM_BINS * 3];
+	processor->histogram(bins);
+
+	if(auto_gain != nullptr) {
+		processor->set_gain(auto_gain->update(bins,
+					processor->get_gain()));
+	}
+
+	if(stats_file != nullptr) {
+		const float percentiles[3] = { 1.0f, 50.0f, gain_percentile };
+		fprintf(stats_file, "%lu,%.4f", index, processor->get_gain());
+		for(unsigned int i = 0; i < 3; i++) {
+			for(unsigned int c = 0; c < 3; c++) {
+				fprintf(stats_file, ",%u", AutoGain::percentile(
+							bins, c,
+							percentiles[i]));
+			}
+		}
+		fprintf(stats_file, "\n");
+		fflush(stats_file);
+	}
 }
 
 struct UserData {
+	ClipState*	clip;
 	VideoProcessor*	processor;
+	Stack*		stack;
 	unsigned long	index;
+	unsigned long	sequence;
 	bool		add;
 	bool		output;
 
-	UserData(VideoProcessor* processor, bool add, bool output)
-			: processor(processor), add(add), output(output) {}
+	UserData(ClipState* clip, VideoProcessor* processor, bool add,
+			bool output)
+			: clip(clip), processor(processor), stack(nullptr),
+			sequence(0), add(add), output(output) {}
 	~UserData() {}
 };
 
+enum OutputKind {
+	OUTPUT_JPEG,
+	OUTPUT_RAW,
+	OUTPUT_DEEP
+};
+
+// An output frame which was read back and still has to be encoded. spec is
+// set for the frames of an additional output.
+struct OutputJob {
+	OutputKind	kind;
+	const OutputSpec* spec;
+	FrameBuffer	buffer;
+	unsigned int	width;
+	unsigned int	height;
+	unsigned long	index;
+};
+
+// The output of the run, as the filter reads it and as it is encoded.
+static brawshot_output_t FilterOutput()
+{
+	if(raw_dump) {
+		return BRAWSHOT_OUTPUT_RAW16;
+	} else if(output_format == FORMAT_EXR) {
+		return BRAWSHOT_OUTPUT_HALF;
+	} else if(output_format != FORMAT_JPEG) {
+		return BRAWSHOT_OUTPUT_GRADED16;
+	}
+	return BRAWSHOT_OUTPUT_BGRA8;
+}
+
+static OutputKind MainOutputKind()
+{
+	if(raw_dump) {
+		return OUTPUT_RAW;
+	}
+	return output_format != FORMAT_JPEG ? OUTPUT_DEEP : OUTPUT_JPEG;
+}
+
+// Renders the additional outputs from the current accumulator, each with its
+// own gain and LUT.
+static void RenderSpecs(ClipState* clip, VideoProcessor* processor,
+		unsigned int width, unsigned int height, unsigned long index,
+		std::vector<OutputJob>& outputs)
+{
+	if(output_specs.empty()) {
+		return;
+	}
+
+	float gain = processor->get_gain();
+	for(size_t i = 0; i < output_specs.size(); i++) {
+		const OutputSpec& spec = output_specs[i];
+		processor->set_gain(spec.gain > 0 ? spec.gain : gain);
+		processor->select_lut(spec.lut);
+
+		OutputJob job;
+		job.spec = &spec;
+		job.buffer = clip->spec_pools[i]->acquire();
+		job.width = width;
+		job.height = height;
+		job.index = index;
+
+		if(spec.raw || !spec.graded) {
+			job.kind = OUTPUT_RAW;
+			processor->output_raw(job.buffer.get<uint16_t>());
+		} else if(spec.format != FORMAT_JPEG) {
+			job.kind = OUTPUT_DEEP;
+			processor->output_deep(job.buffer.get<uint16_t>(),
+					spec.format == FORMAT_EXR);
+		} else {
+			job.kind = OUTPUT_JPEG;
+			processor->output(job.buffer.get<uint8_t>());
+		}
+
+		outputs.push_back(std::move(job));
+	}
+
+	processor->set_gain(gain);
+	processor->select_lut(main_lut);
+}
+
+// Counts a frame of the clip as accumulated.
+static void FrameDone(ClipState* clip)
+{
+	Metrics::add(metrics.accumulated);
+	Metrics::add(metrics.clip_done);
+	clip->frames_done++;
+}
+
+static void ApplyFrame(PendingFrame& frame, std::vector<OutputJob>& outputs)
+{
+	UserData* userData = frame.userData;
+	ClipState* clip = userData->clip;
+	unsigned int width = frame.width;
+	unsigned int height = frame.height;
+
+	if(frame.processedImage == nullptr) {
+		--clip->jobs_in_flight;
+		delete userData;
+		return;
+	}
+
+	// the frames leaving the window are decoded again and subtracted
+	bool full = false;
+	if(userData->add) {
+		full = brawshot_add(clip->filter, frame.image) != 0;
+		FrameDone(clip);
+	} else {
+		brawshot_subtract(clip->filter, frame.image);
+	}
+
+	if(userData->output && full) {
+		ApplyStatistics(userData->processor, userData->index);
+
+		OutputJob job;
+		job.spec = nullptr;
+		job.kind = MainOutputKind();
+		job.buffer = clip->frame_pool->acquire();
+		job.width = width;
+		job.height = height;
+		job.index = userData->index;
+
+		brawshot_read(clip->filter, job.buffer.get<void>());
+		if(job.kind != OUTPUT_DEEP) {
+			ReserveOutput(userData->index);
+		}
+
+		outputs.push_back(std::move(job));
+
+		RenderSpecs(clip, userData->processor, width, height,
+				userData->index, outputs);
+	}
+
+	if(autotuner != nullptr && userData->add) {
+		autotuner->frame();
+	}
+
+	frame.processedImage->Release();
+	delete userData;
+
+	--clip->jobs_in_flight;
+}
+
+static void QueueFrame(const PendingFrame& frame)
+{
+	std::vector<OutputJob> outputs;
+	ClipState* clip = frame.userData->clip;
+
+	std::unique_lock<std::mutex> guard(clip->apply_lock);
+	clip->apply_queue[frame.userData->sequence] = frame;
+	if(clip->applying) {
+		return;
+	}
+
+	clip->applying = true;
+	while(true) {
+		auto it = clip->apply_queue.find(clip->apply_next);
+		if(it == clip->apply_queue.end()) {
+			break;
+		}
+		PendingFrame next = it->second;
+		clip->apply_queue.erase(it);
+		clip->apply_next++;
+
+		guard.unlock();
+		ApplyFrame(next, outputs);
+		guard.lock();
+	}
+	clip->applying = false;
+	guard.unlock();
+
+	// the next frames can already be applied by another thread while
+	// these are encoded
+	for(OutputJob& job : outputs) {
+		if(job.spec != nullptr) {
+			output_spec(clip, job.spec, job.width, job.height,
+					std::move(job.buffer), job.index);
+			continue;
+		}
+
+		switch(job.kind) {
+			case OUTPUT_RAW:
+				output_raw(clip, job.width, job.height,
+						std::move(job.buffer), job.index);
+				break;
+			case OUTPUT_DEEP:
+				output_deep(clip, job.width, job.height,
+						std::move(job.buffer), job.index);
+				break;
+			default:
+				output_image(clip, job.width, job.height,
+						std::move(job.buffer), job.index);
+				break;
+		}
+	}
+}
+
+// Reads the queue depths for the metrics exporter.
+static void SampleQueues()
+{
+	unsigned int decode_queue = 0;
+	unsigned int apply_queue = 0;
+	{
+		std::lock_guard<std::mutex> guard(clips_lock);
+		for(ClipState* clip : active_clips) {
+			int jobs = clip->jobs_in_flight;
+			decode_queue += jobs > 0 ? jobs : 0;
+
+			std::lock_guard<std::mutex> apply(clip->apply_lock);
+			apply_queue += clip->apply_queue.size();
+		}
+	}
+	metrics.decode_queue = decode_queue;
+	metrics.apply_queue = apply_queue;
+
+	metrics.encode_queue = encoders != nullptr ? encoders->get_queued() : 0;
+	metrics.write_queue = writer != nullptr ? writer->get_pending() : 0;
+}
+
 class CameraCodecCallback : public IBlackmagicRawCallback
 {
 public:
@@ -105,6 +1051,10 @@ public:
 			VERIFY(frame->SetResourceFormat(s_resourceFormat));
 		}
 
+		if(result == S_OK && scale_factor > 1) {
+			VERIFY(frame->SetResolutionScale(resolution_scale));
+		}
+
 		if(result == S_OK) {
 			result = frame->CreateJobDecodeAndProcessFrame(nullptr, nullptr, &decodeAndProcessJob);
 		}
@@ -121,6 +1071,17 @@ public:
 			if(decodeAndProcessJob) {
 				decodeAndProcessJob->Release();
 			}
+
+			// the frames after this one must not wait for it
+			if(userData->stack != nullptr) {
+				--userData->clip->jobs_in_flight;
+				delete userData;
+			} else {
+				PendingFrame pending;
+				pending.userData = userData;
+				pending.processedImage = nullptr;
+				QueueFrame(pending);
+			}
 		}
 
 		readJob->Release();
@@ -146,38 +1107,49 @@ public:
 		UserData* userData = nullptr;
 		VERIFY(job->GetUserData((void**)&userData));
 
-		if(result == S_OK) {
-			if(userData->add) {
-				userData->processor->add((uint16_t*) imageData);
-			} else {
-				userData->processor->subtract((uint16_t*) imageData);
-			}
+		// the crop and the bands are read straight out of the frame
+		if(result == S_OK && (width != userData->clip->frame_width ||
+					height != userData->clip->frame_height)) {
+			printf("Unexpected frame size %ux%u\n", width, height);
+			exit(1);
+		}
 
-			if(userData->output) {
-				if(raw_dump) {
-					uint16_t* output = new uint16_t[width * height * 4];
-					userData->processor->output_raw(output);
+		if(result == S_OK) {
+			Metrics::add(metrics.decoded);
+		}
 
-					--jobsInFlight;
-					unsigned long index = userData->index;
-					output_raw(width, height, output, index);
-					delete[] output;
-				} else {
-					uint8_t* output = new uint8_t[width * height * 4];
-					userData->processor->output(output);
+		uint16_t* image = (uint16_t*) imageData;
+		if(crop) {
+			// the processor reads the crop directly out of the frame
+			image += ((size_t) crop_y * width + crop_x) * 4;
+			width = crop_width;
+			height = crop_height;
+		}
 
-					--jobsInFlight;
-					unsigned long index = userData->index;
-					output_image(width, height, output, index);
-					delete[] output;
-				}
-			} else {
-				--jobsInFlight;
+		if(userData->stack != nullptr) {
+			// stacking runs on the decode threads, not on the GPU
+			if(result == S_OK) {
+				userData->stack->add(image,
+						userData->clip->frame_width);
+				FrameDone(userData->clip);
+			}
+			--userData->clip->jobs_in_flight;
+			delete userData;
+		} else {
+			PendingFrame pending;
+			pending.userData = userData;
+			pending.processedImage = nullptr;
+			pending.image = image;
+			pending.width = width;
+			pending.height = height;
+			if(result == S_OK) {
+				// kept until the frame was applied
+				processedImage->AddRef();
+				pending.processedImage = processedImage;
 			}
+			QueueFrame(pending);
 		}
 
-		delete userData;
-
 		job->Release();
 	}
 
@@ -201,8 +1173,311 @@ public:
 	}
 };
 
-HRESULT ProcessClip(IBlackmagicRawClip* clip, const char* lut_filename,
-		unsigned int window_size, float gain)
+// Creates the processor for the first clip and reuses it for all further
+// clips, so that the EGL context, shaders and LUT stay resident. The
+// processors of concurrent clips are created in the group of the first one
+// and share its shaders and LUTs. filter is set to a new filter which drives
+// the processor through the windows of the clip.
+static bool PrepareProcessor(VideoProcessor** processor, brawshot_t** filter,
+		unsigned int width, unsigned int height,
+		const char* lut_filename, float gain, unsigned int window,
+		unsigned int ring)
+{
+	unsigned int stride = width;
+	unsigned int clip_height = height;
+	if(crop) {
+		if(crop_x + crop_width > width || crop_y + crop_height > height) {
+			printf("The crop does not fit into the %ux%u clip\n",
+					width, height);
+			return false;
+		}
+		width = crop_width;
+		height = crop_height;
+	}
+
+	// the 16bit and half float outputs of the run and the output specs
+	bool deep = output_format == FORMAT_TIFF ||
+		output_format == FORMAT_PNG;
+	bool half = output_format == FORMAT_EXR;
+	for(const OutputSpec& spec : output_specs) {
+		if(!spec.raw && spec.graded && spec.format != FORMAT_JPEG) {
+			deep |= spec.format != FORMAT_EXR;
+			half |= spec.format == FORMAT_EXR;
+		}
+	}
+
+	unsigned int tile_height = 0;
+	if(vram_budget) {
+		tile_height = VideoProcessor::tile_height_for_budget(width,
+				height, vram_budget, ref_filename != nullptr,
+				ring, deep + half,
+				VideoProcessor::narrow_accumulator(window,
+					input_bits, ring));
+		if(tile_height == 0) {
+			printf("A %ux%u frame does not fit into the VRAM budget\n",
+					width, height);
+			return false;
+		}
+	}
+
+	bool load_ref;
+	if(*processor == nullptr) {
+		std::lock_guard<std::mutex> guard(processor_lock);
+		*processor = new VideoProcessor(width, height, gain,
+				lut_filename, tile_height, processor_group);
+		if(deep) {
+			(*processor)->set_deep_output(false);
+		}
+		if(half) {
+			(*processor)->set_deep_output(true);
+		}
+
+		if(processor_group == nullptr) {
+			main_lut = lut_filename != nullptr ? 0 : -1;
+			for(OutputSpec& spec : output_specs) {
+				if(spec.no_lut) {
+					spec.lut = -1;
+				} else if(spec.lut_filename.empty()) {
+					spec.lut = main_lut;
+				} else {
+					spec.lut = (*processor)->add_lut(
+						spec.lut_filename.c_str());
+				}
+			}
+			processor_group = *processor;
+		}
+		load_ref = true;
+	} else {
+		load_ref = (*processor)->resize(width, height, tile_height);
+	}
+
+	(*processor)->set_input_stride(stride);
+
+	if(!(*processor)->set_robust(ring, robust_median, robust_kappa)) {
+		return false;
+	}
+
+	(*processor)->set_window(window, input_bits);
+
+	if(defect_map != nullptr) {
+		if(!defect_map->matches(stride, clip_height)) {
+			printf("The defect map does not fit the %ux%u clip\n",
+					stride, clip_height);
+			return false;
+		}
+
+		std::vector<unsigned int> points = defect_map->transform(stride,
+				clip_height, crop ? crop_x : 0,
+				crop ? crop_y : 0, width, height);
+		(*processor)->set_defects(points.data(), points.size() / 2);
+	}
+
+	if((*processor)->get_bands() > 1) {
+		printf("Processing in %u bands of %u rows\n",
+				(*processor)->get_bands(), tile_height);
+	}
+
+	brawshot_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.width = width;
+	config.height = height;
+	config.window = window;
+	config.output = FilterOutput();
+	*filter = brawshot_attach(*processor, &config);
+
+	if(ref_filename != nullptr && load_ref) {
+		// the reference frame is either a full frame, which is cropped
+		// here, or was already recorded with the same crop
+		size_t full_size = (size_t) stride * clip_height;
+		size_t size = (size_t) width * height;
+
+		ReferenceHeader header;
+		bool has_header;
+		size_t pixels;
+		uint16_t* image = read_reference(ref_filename, &pixels,
+				&header, &has_header);
+		if(image == nullptr) {
+			return false;
+		}
+
+		bool full = has_header ? header.width == stride &&
+			header.height == clip_height : pixels == full_size;
+		bool cropped = has_header ? header.width == width &&
+			header.height == height : pixels == size;
+		if(!full && !cropped) {
+			printf("Reference frame %s has the wrong size\n",
+					ref_filename);
+			delete[] image;
+			return false;
+		}
+
+		// the filter reads the reference with the stride of the clip
+		// like the frames, so a full frame is read at the crop and a
+		// cropped one is spread out to that stride; the mean in the
+		// header is only valid for the whole frame
+		const uint16_t* ref = image;
+		std::vector<uint16_t> rows;
+		if(!cropped) {
+			ref = &image[((size_t) crop_y * stride + crop_x) * 4];
+		} else if(width != stride) {
+			rows.resize((size_t) stride * height * 4);
+			for(unsigned int y = 0; y < height; y++) {
+				memcpy(&rows[(size_t) y * stride * 4],
+						&image[(size_t) y * width * 4],
+						width * sizeof(uint16_t) * 4);
+			}
+			ref = rows.data();
+		}
+
+		brawshot_load_reference_mean(*filter, ref, ref_after_lut,
+				has_header && cropped ? header.mean : nullptr);
+		delete[] image;
+	}
+
+	return true;
+}
+
+// Returns the number of frames which are accumulated before the first output
+// frame, i.e. the effective window size.
+static unsigned long OutputDelay(unsigned long frameCount,
+		unsigned int window_size)
+{
+	// with a sample stride, the clip is processed as if it only consisted
+	// of every sample_stride-th frame; the window covers the same time
+	frameCount = (frameCount + sample_stride - 1) / sample_stride;
+	window_size = (window_size + sample_stride - 1) / sample_stride;
+
+	unsigned long output_delay = window_size;
+	if(single) {
+		output_delay = frameCount;
+	}
+	if(output_delay > frameCount) {
+		output_delay = frameCount;
+	}
+
+	return output_delay;
+}
+
+// Returns the number of decode jobs which fit into the tuning memory budget:
+// every job holds a decoded frame and, until it is written, an output frame.
+static unsigned int MaxDecodeJobs(unsigned int frame_width,
+		unsigned int width, unsigned int height, unsigned int clip_height)
+{
+	size_t budget = tune_memory;
+	if(budget == 0) {
+		budget = (size_t) sysconf(_SC_PHYS_PAGES) *
+			sysconf(_SC_PAGESIZE) / 4;
+	}
+
+	size_t frame = (size_t) frame_width * clip_height * 8 +
+		(size_t) width * height * 8;
+	size_t jobs = budget / frame;
+
+	// beyond that, the SDK's queues are full anyway
+	if(jobs > 32) {
+		jobs = 32;
+	}
+
+	return jobs > 0 ? (unsigned int) jobs : 1;
+}
+
+// Starts the autotuner for a clip, unless the profile already has an entry
+// for this host, frame size and format.
+static void StartAutotune(unsigned int frame_width, unsigned int width,
+		unsigned int height, unsigned int clip_height)
+{
+	const char* format = raw_dump ? "raw" :
+		format_extension(output_format);
+	std::string key = profile_key(width, height, format);
+
+	unsigned int jobs, threads;
+	if(profile_filename != nullptr &&
+			load_profile(profile_filename, key, &jobs, &threads)) {
+		printf("Autotune: using profile, %u decode jobs, %u encoder threads\n",
+				jobs, threads);
+		decode_jobs = jobs;
+		while(encoders != nullptr && encoders->get_threads() < threads) {
+			encoders->add_thread();
+		}
+		return;
+	}
+
+	autotuner = new Autotuner(MaxDecodeJobs(frame_width, width, height,
+				clip_height),
+			encoders,
+			std::thread::hardware_concurrency());
+}
+
+static void FinishAutotune(unsigned int width, unsigned int height)
+{
+	if(autotuner == nullptr) {
+		return;
+	}
+
+	if(autotuner->is_done()) {
+		unsigned int threads = encoders != nullptr ?
+			encoders->get_threads() : 0;
+
+		printf("Autotune: %u decode jobs, %u encoder threads (%.1f fps)\n",
+				autotuner->get_jobs(), threads,
+				autotuner->get_fps());
+
+		decode_jobs = autotuner->get_jobs();
+
+		if(profile_filename != nullptr) {
+			const char* format = raw_dump ? "raw" :
+				format_extension(output_format);
+			save_profile(profile_filename,
+					profile_key(width, height, format),
+					decode_jobs, threads);
+		}
+	} else {
+		printf("Autotune: the clip was too short to finish tuning\n");
+	}
+
+	delete autotuner;
+	autotuner = nullptr;
+}
+
+// Adds the clip to the metrics of the clips in progress.
+static void StartMetrics(ClipState* state, uint64_t frames, size_t gpu_memory)
+{
+	state->frames = frames;
+	state->gpu_memory = gpu_memory;
+	metrics.clip_frames += frames;
+	metrics.gpu_memory += gpu_memory;
+}
+
+static void StopMetrics(ClipState* state)
+{
+	metrics.clip_frames -= state->frames;
+	metrics.clip_done -= state->frames_done;
+	metrics.gpu_memory -= state->gpu_memory;
+}
+
+// Waits until all output frames of the clip are written and applies the
+// fsync policy to them. A single clip simply drains the encoders and the
+// writer.
+static void WaitOutputs(ClipState* state)
+{
+	if(concurrent_clips == 1) {
+		if(encoders != nullptr) {
+			encoders->wait();
+		}
+		writer->wait();
+		return;
+	}
+
+	while(state->outputs_pending > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	writer->sync(state->prefix);
+}
+
+HRESULT ProcessClip(ClipState* state, IBlackmagicRawClip* clip,
+		const char* clipName, VideoProcessor& processor,
+		const char* lut_filename, unsigned int window_size, float gain)
 {
 	HRESULT result;
 
@@ -215,48 +1490,165 @@ HRESULT ProcessClip(IBlackmagicRawClip* clip, const char* lut_filename,
 	result = clip->GetWidth(&width);
 	result = clip->GetHeight(&height);
 
-	VideoProcessor processor(width, height, gain, lut_filename);
+	width /= scale_factor;
+	height /= scale_factor;
 
-	if(ref_filename != nullptr) {
-		FILE* f = fopen(ref_filename, "rb");
-		uint16_t* image = new uint16_t[width * height * 4];
-		fread(image, width * height * sizeof(uint16_t), 4, f);
-		fclose(f);
-		processor.load_reference(image, ref_after_lut);
-		delete[] image;
+	unsigned int clip_height = height;
+	if(crop) {
+		width = crop_width;
+		height = crop_height;
 	}
 
 	result = clip->GetFrameCount(&frameCount);
 
-	unsigned long output_delay = window_size;
-	if(single) {
-		output_delay = frameCount;
+	unsigned long output_delay = OutputDelay(frameCount, window_size);
+	frameCount = (frameCount + sample_stride - 1) / sample_stride;
+	window_size = (window_size + sample_stride - 1) / sample_stride;
+
+	// enough digits for the last output frame, so the names sort correctly
+	for(unsigned long n = frameCount - output_delay; n >= 10000;
+			n /= 10) {
+		state->digits++;
 	}
-	if(output_delay > frameCount) {
-		output_delay = frameCount;
+
+	// Each shard renders a contiguous range of output frames. The first
+	// window - 1 frames of the range are only accumulated, so the result is
+	// identical to the corresponding frames of a serial run.
+	unsigned long firstFrame = 0;
+	unsigned long lastFrame = frameCount;
+	if(shard_count) {
+		unsigned long outputs = frameCount - output_delay + 1;
+		unsigned long first = outputs * shard_index / shard_count;
+		unsigned long last = outputs * (shard_index + 1) / shard_count;
+		if(first == last) {
+			printf("Shard %u/%u has no frames to process\n",
+					shard_index, shard_count);
+			return S_OK;
+		}
+		firstFrame = first;
+		lastFrame = last + output_delay - 1;
+	}
+
+	frameIndex = firstFrame;
+
+	Checkpoint* checkpoint = nullptr;
+	bool checkpoint_valid = false;
+	if(checkpoint_interval || resume) {
+		char checkpoint_filename[256];
+		char options[1024];
+		// every shard keeps its own checkpoint of its own range
+		char shard[32] = "";
+		if(shard_count) {
+			snprintf(shard, sizeof(shard), "-shard%uof%u",
+					shard_index, shard_count);
+		}
+		snprintf(checkpoint_filename, sizeof(checkpoint_filename),
+				"%s%s.ckpt", state->prefix.c_str(), shard);
+		// everything which changes the accumulated samples or the
+		// format of the accumulator
+		bool narrow = VideoProcessor::narrow_accumulator(output_delay,
+				input_bits, robust ? output_delay : 0);
+		snprintf(options, sizeof(options),
+				"%s|%ux%u|%lu|%s|%s|%d|%u|%.9g|%d|%d|%lu-%lu|"
+				"%u,%u|%u|%u|%d",
+				clipName, width, height, frameCount,
+				lut_filename ? lut_filename : "",
+				ref_filename ? ref_filename : "",
+				ref_after_lut, window_size, gain, single,
+				raw_dump, firstFrame, lastFrame,
+				crop ? crop_x : 0, crop ? crop_y : 0,
+				scale_factor, input_bits, narrow);
+		checkpoint = new Checkpoint(checkpoint_filename, options,
+				width, height);
+
+		if(resume) {
+			if(access(checkpoint_filename, F_OK) != 0) {
+				printf("No checkpoint found, starting from the beginning\n");
+			} else if(checkpoint->load(&processor, &frameIndex)) {
+				printf("Resuming at frame %lu\n", frameIndex);
+				checkpoint_valid = true;
+			} else {
+				delete checkpoint;
+				return E_FAIL;
+			}
+		}
+	}
+
+	unsigned long checkpoint_start = frameIndex;
+	unsigned long checkpoint_frame = frameIndex;
+
+	// sequence numbers of the submitted jobs, in the order they have to be
+	// applied
+	unsigned long sequence = 0;
+
+	if(autotune) {
+		StartAutotune(state->frame_width, width, height, clip_height);
 	}
 
-	while(frameIndex < frameCount) {
-		if(jobsInFlight >= s_maxJobsInFlight) {
+	StartMetrics(state, lastFrame - frameIndex,
+			processor.get_gpu_memory());
+
+	while(frameIndex < lastFrame) {
+		int max_jobs = autotuner != nullptr ? autotuner->get_jobs() :
+			decode_jobs;
+		if(state->jobs_in_flight >= max_jobs) {
 			std::this_thread::sleep_for(std::chrono::microseconds(100));
 			continue;
 		}
 
-		float percent = frameIndex * 100.0 / (frameCount - 1);
-		printf("\r\x1b[KProcessing frame %lu [%5.1f%%]", frameIndex, percent);
-		fflush(stdout);
+		if(checkpoint_interval && frameIndex != checkpoint_start &&
+				frameIndex % checkpoint_interval == 0) {
+			// the accumulator is only consistent once all
+			// submitted frames have been applied
+			while(state->jobs_in_flight > 0) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+			// and the frames before the checkpoint are never
+			// rendered again
+			WaitOutputs(state);
+			if(checkpoint->save(&processor, frameIndex)) {
+				checkpoint_valid = true;
+				checkpoint_frame = frameIndex;
+			} else if(checkpoint_valid) {
+				printf("\nWARNING: the checkpoint was not updated, --resume would restart at frame %lu\n",
+						checkpoint_frame);
+			} else {
+				printf("\nWARNING: no valid checkpoint is being kept, --resume would start from the beginning\n");
+			}
+			checkpoint_start = frameIndex;
+		}
 
-		bool output = frameIndex >= output_delay - 1;
-		if(frameIndex >= output_delay) {
+		float percent = (frameIndex - firstFrame) * 100.0 /
+			(lastFrame - firstFrame - 1);
+		if(concurrent_clips == 1) {
+			printf("\r\x1b[KProcessing frame %lu [%5.1f%%]", frameIndex, percent);
+			fflush(stdout);
+		}
+		ReportProgress(state, percent);
+
+		// the filter only renders once the window is full, e.g. not
+		// for the first frames of a shard
+		bool output = frameIndex + 1 >= output_delay &&
+			keep_output(frameIndex - output_delay + 1);
+		if(output && resume && output_complete(state, width, height,
+					frameIndex - output_delay + 1)) {
+			output = false;
+		}
+
+		// the ring of the robust stack drops old frames by itself
+		if(frameIndex >= firstFrame + output_delay && !robust) {
 			unsigned long idx = frameIndex - output_delay;
 			IBlackmagicRawJob* jobRead = nullptr;
 			if(result == S_OK) {
-				result = clip->CreateJobReadFrame(idx, &jobRead);
+				result = clip->CreateJobReadFrame(idx * sample_stride,
+						&jobRead);
 			}
 
 			UserData* userData = nullptr;
 			if(result == S_OK) {
-				userData = new UserData(&processor, false, false);
+				userData = new UserData(state, &processor,
+						false, false);
+				userData->sequence = sequence++;
 				VERIFY(jobRead->SetUserData(userData));
 			}
 
@@ -272,24 +1664,27 @@ HRESULT ProcessClip(IBlackmagicRawClip* clip, const char* lut_filename,
 				break;
 			}
 
-			++jobsInFlight;
+			++state->jobs_in_flight;
 
-			while(jobsInFlight >= s_maxJobsInFlight) {
+			while(state->jobs_in_flight >= max_jobs) {
 				std::this_thread::sleep_for(std::chrono::microseconds(100));
 			}
 		}
 
 		IBlackmagicRawJob* jobRead = nullptr;
 		if(result == S_OK) {
-			result = clip->CreateJobReadFrame(frameIndex, &jobRead);
+			result = clip->CreateJobReadFrame(frameIndex * sample_stride,
+					&jobRead);
 		}
 
 		UserData* userData = nullptr;
 		if(result == S_OK) {
-			userData = new UserData(&processor, true, output);
+			userData = new UserData(state, &processor, true,
+					output);
 			if(output) {
 				userData->index = frameIndex - output_delay + 1;
 			}
+			userData->sequence = sequence++;
 			VERIFY(jobRead->SetUserData(userData));
 		}
 
@@ -305,139 +1700,1404 @@ HRESULT ProcessClip(IBlackmagicRawClip* clip, const char* lut_filename,
 			break;
 		}
 
-		++jobsInFlight;
+		++state->jobs_in_flight;
 
 		frameIndex++;
 	}
 
-	printf("\n");
-
-	printf("Waiting for jobs to finish...\n");
+	if(concurrent_clips == 1) {
+		printf("\n");
+		printf("Waiting for jobs to finish...\n");
+	}
 
-	while(jobsInFlight > 0) {
+	while(state->jobs_in_flight > 0) {
 		std::this_thread::sleep_for(std::chrono::microseconds(50));
 	}
 
+	FinishAutotune(width, height);
+
+	if(checkpoint != nullptr) {
+		if(result == S_OK) {
+			checkpoint->remove();
+		}
+		delete checkpoint;
+	}
+
 	return result;
 }
 
-int main(int argc, const char** argv)
+// Averages the whole clip into a single image. Unlike the sliding window,
+// frames are decoded and summed in parallel and the sum cannot overflow.
+HRESULT StackClip(ClipState* state, IBlackmagicRawClip* clip,
+		VideoProcessor& processor)
 {
-	const char* self = *argv;
-	const char* lut_filename = nullptr;
-	const char* clipName = nullptr;
-	unsigned int window_size = 100;
-	float gain = 1.0f;
+	HRESULT result = S_OK;
 
-	argc--;
-	argv++;
+	long unsigned int frameCount = 0;
+	long unsigned int frameIndex = 0;
 
-	for(; argc; argc--, argv++) {
-		if(!strcmp(*argv, "-l") && argc > 1) {
-			lut_filename = argv[1];
-			argc--;
-			argv++;
-		} else if(!strcmp(*argv, "-o") && argc > 1) {
-			outputFileName = argv[1];
-			argc--;
-			argv++;
-		} else if(!strcmp(*argv, "-i") && argc > 1) {
-			clipName = argv[1];
-			argc--;
-			argv++;
-		} else if(!strcmp(*argv, "-g") && argc > 1) {
-			gain = (float) atof(argv[1]);
-			argc--;
-			argv++;
-		} else if(!strcmp(*argv, "-r") && argc > 1) {
-			ref_filename = argv[1];
-			argc--;
-			argv++;
-		} else if(!strcmp(*argv, "-L")) {
-			ref_after_lut = true;
-		} else if(!strcmp(*argv, "-s")) {
-			single = true;
-		} else if(!strcmp(*argv, "-R")) {
-			raw_dump = true;
-			single = true;
-		} else if(!strcmp(*argv, "-w") && argc > 1) {
-			int win = atoi(argv[1]);
-			if(win < 0) {
-				std::cerr << "Invalid window size" << std::endl;
-				return 1;
-			}
-			window_size = (unsigned int) win;
-			argc--;
-			argv++;
-		} else {
-			std::cerr << "Usage: " << self << " -i clip.braw [-o image.bmp]" << std::endl;
-			return 1;
-		}
-	}
+	unsigned int width = 0;
+	unsigned int height = 0;
 
-	if(clipName == nullptr) {
-		std::cerr << "Missing clip name" << std::endl;
-		return 1;
+	result = clip->GetWidth(&width);
+	result = clip->GetHeight(&height);
+
+	width /= scale_factor;
+	height /= scale_factor;
+
+	if(crop) {
+		width = crop_width;
+		height = crop_height;
 	}
 
-	tjinst = tjInitCompress();
+	result = clip->GetFrameCount(&frameCount);
+	frameCount = (frameCount + sample_stride - 1) / sample_stride;
 
-	HRESULT result = S_OK;
+	Stack stack(width, height, stack_jobs);
 
-	IBlackmagicRawFactory* factory = nullptr;
-	IBlackmagicRaw* codec = nullptr;
-	IBlackmagicRawClip* clip = nullptr;
+	StartMetrics(state, frameCount, processor.get_gpu_memory());
 
-	CameraCodecCallback callback;
+	for(frameIndex = 0; frameIndex < frameCount; frameIndex++) {
+		while(state->jobs_in_flight >= (int) stack_jobs) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
 
-	unsigned int width = 0;
-	unsigned int height = 0;
+		float percent = frameIndex * 100.0 / frameCount;
+		if(concurrent_clips == 1) {
+			printf("\r\x1b[KStacking frame %lu [%5.1f%%]", frameIndex, percent);
+			fflush(stdout);
+		}
+		ReportProgress(state, percent);
 
-	factory = CreateBlackmagicRawFactoryInstanceFromPath(BRAWSDK_ROOT "/Libraries/");
-	if(factory == nullptr) {
-		std::cerr << "Failed to create IBlackmagicRawFactory!" << std::endl;
-		goto end;
-	}
+		IBlackmagicRawJob* jobRead = nullptr;
+		if(result == S_OK) {
+			result = clip->CreateJobReadFrame(frameIndex * sample_stride,
+					&jobRead);
+		}
 
-	result = factory->CreateCodec(&codec);
-	if(result != S_OK) {
-		std::cerr << "Failed to create IBlackmagicRaw!" << std::endl;
-		goto end;
-	}
+		UserData* userData = nullptr;
+		if(result == S_OK) {
+			userData = new UserData(state, &processor, true,
+					false);
+			userData->stack = &stack;
+			VERIFY(jobRead->SetUserData(userData));
+		}
 
-	result = codec->OpenClip(clipName, &clip);
-	if(result != S_OK) {
-		std::cerr << "Failed to open IBlackmagicRawClip!" << std::endl;
-		goto end;
+		if(result == S_OK) {
+			result = jobRead->Submit();
+		}
+
+		if(result != S_OK) {
+			if(jobRead != nullptr) {
+				jobRead->Release();
+			}
+
+			break;
+		}
+
+		++state->jobs_in_flight;
 	}
 
-	result = codec->SetCallback(&callback);
-	if(result != S_OK) {
-		std::cerr << "Failed to set IBlackmagicRawCallback!" << std::endl;
-		goto end;
+	if(concurrent_clips == 1) {
+		printf("\n");
+		printf("Waiting for jobs to finish...\n");
 	}
 
-	result = clip->GetWidth(&width);
-	if(result != S_OK) {
-		std::cerr << "Failed to get image width!" << std::endl;
-		goto end;
+	while(state->jobs_in_flight > 0) {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
 	}
 
-	result = clip->GetHeight(&height);
 	if(result != S_OK) {
-		std::cerr << "Failed to get image height!" << std::endl;
-		goto end;
+		return result;
 	}
 
-	ProcessClip(clip, lut_filename, window_size, gain);
-
-	codec->FlushJobs();
+	printf("Stacked %lu frames\n", stack.get_count());
+
+	if(find_defects) {
+		uint16_t* output = new uint16_t[(size_t) width * height * 4];
+		stack.mean_raw(output);
+
+		DefectMap map;
+		map.find(output, width, height, defect_sigma);
+		delete[] output;
+
+		printf("Found %u defective pixels\n", map.get_count());
+
+		std::string text = map.format();
+		char filename[256];
+		get_filename(state, filename, "txt", 0);
+		write_file(filename, text.data(), text.size());
+	} else if(build_dark) {
+		// master dark: raw dump with a header, so that the mean does
+		// not have to be computed again whenever it is loaded
+		size_t size = (size_t) width * height * 4 * sizeof(uint16_t);
+		uint8_t* data = new uint8_t[sizeof(ReferenceHeader) + size];
+		uint16_t* output = (uint16_t*) (data + sizeof(ReferenceHeader));
+		stack.mean_raw(output);
+
+		ReferenceHeader header;
+		reference_header(&header, output, width, height,
+				stack.get_count());
+		memcpy(data, &header, sizeof(header));
+
+		char filename[256];
+		get_filename(state, filename, "raw", 0);
+		write_file(filename, data, sizeof(ReferenceHeader) + size);
+		delete[] data;
+	} else if(raw_dump && defect_map == nullptr) {
+		FrameBuffer output = state->frame_pool->acquire();
+		stack.mean_raw(output.get<uint16_t>());
+		output_raw(state, width, height, std::move(output), 0);
+	} else {
+		// the mean as a single sample renders exactly like the sum
+		uint32_t* mean = new uint32_t[(size_t) width * height * 3];
+		stack.mean(mean);
+		processor.load_state(mean, 1);
+		delete[] mean;
+
+		ApplyStatistics(&processor, 0);
+
+		// with raw_dump, only the processor corrects defective pixels
+		FrameBuffer output = state->frame_pool->acquire();
+		brawshot_read(state->filter, output.get<void>());
+		switch(MainOutputKind()) {
+			case OUTPUT_RAW:
+				output_raw(state, width, height,
+						std::move(output), 0);
+				break;
+			case OUTPUT_DEEP:
+				output_deep(state, width, height,
+						std::move(output), 0);
+				break;
+			default:
+				output_image(state, width, height,
+						std::move(output), 0);
+				break;
+		}
+	}
+
+	return result;
+}
+
+// Processes a clip into the output files starting with prefix. job is the
+// batch job of the clip, or -1.
+HRESULT ProcessFile(IBlackmagicRaw* codec, const char* clipName,
+		const char* prefix, long job, VideoProcessor** processor,
+		const char* lut_filename, unsigned int window_size, float gain)
+{
+	HRESULT result = S_OK;
+
+	IBlackmagicRawClip* clip = nullptr;
+	ClipState state(prefix, job);
+
+	unsigned int width = 0;
+	unsigned int height = 0;
+	unsigned int window = 1;
+	unsigned int ring = 0;
+	unsigned long frameCount = 0;
+
+	result = codec->OpenClip(clipName, &clip);
+	if(result != S_OK) {
+		std::cerr << "Failed to open IBlackmagicRawClip!" << std::endl;
+		goto end;
+	}
+
+	result = clip->GetWidth(&width);
+	if(result != S_OK) {
+		std::cerr << "Failed to get image width!" << std::endl;
+		goto end;
+	}
+
+	result = clip->GetHeight(&height);
+	if(result != S_OK) {
+		std::cerr << "Failed to get image height!" << std::endl;
+		goto end;
+	}
+
+	width /= scale_factor;
+	height /= scale_factor;
+	state.frame_width = width;
+	state.frame_height = height;
+
+	result = clip->GetFrameCount(&frameCount);
+	if(result != S_OK) {
+		std::cerr << "Failed to get frame count!" << std::endl;
+		goto end;
+	}
+
+	// the stacked mean is loaded as a single sample
+	if(!stack_mode) {
+		window = OutputDelay(frameCount, window_size);
+	}
+	if(robust) {
+		ring = window;
+	}
+
+	if(auto_gain != nullptr) {
+		auto_gain->reset();
+	}
+
+	if(!PrepareProcessor(processor, &state.filter, width, height,
+				lut_filename, gain, window, ring)) {
+		result = E_FAIL;
+		goto end;
+	}
+
+	// 8 bytes per pixel for RAW and 16bit output, 4 for JPEG
+	state.frame_pool = new BufferPool((size_t) (crop ? crop_width : width) *
+			(crop ? crop_height : height) *
+			(raw_dump || output_format != FORMAT_JPEG ? 8 : 4),
+			huge_pages, lock_buffers);
+
+	for(const OutputSpec& spec : output_specs) {
+		bool bgra = !spec.raw && spec.graded &&
+			spec.format == FORMAT_JPEG;
+		state.spec_pools.push_back(new BufferPool((size_t) (crop ?
+					crop_width : width) * (crop ?
+					crop_height : height) * (bgra ? 4 : 8),
+				huge_pages, lock_buffers));
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(clips_lock);
+		active_clips.insert(&state);
+	}
+
+	if(stream_fd >= 0) {
+		float fps = 0;
+		clip->GetFrameRate(&fps);
+		stream = new StreamWriter(stream_fd, stream_format,
+				crop ? crop_width : width,
+				crop ? crop_height : height, fps / sample_stride);
+	}
+
+	if(mkv) {
+		float fps = 0;
+		clip->GetFrameRate(&fps);
+
+		char filename[256];
+		snprintf(filename, sizeof(filename), "%s.mkv", prefix);
+		container = new MatroskaWriter(filename,
+				crop ? crop_width : width,
+				crop ? crop_height : height, fps / sample_stride);
+	}
+
+	if(stack_mode) {
+		result = StackClip(&state, clip, **processor);
+	} else {
+		result = ProcessClip(&state, clip, clipName, **processor,
+				lut_filename, window_size, gain);
+	}
+
+	// the codec is shared by the concurrent clips, which all wait for
+	// their own jobs instead
+	if(concurrent_clips == 1) {
+		codec->FlushJobs();
+	}
+
+	WaitOutputs(&state);
+
+	{
+		std::lock_guard<std::mutex> guard(clips_lock);
+		active_clips.erase(&state);
+	}
+	StopMetrics(&state);
+
+	if(stream != nullptr) {
+		// waits for the remaining frames
+		delete stream;
+		stream = nullptr;
+	}
+
+	if(container != nullptr) {
+		container->close();
+		delete container;
+		container = nullptr;
+	}
+
+	delete state.frame_pool;
+	for(BufferPool* pool : state.spec_pools) {
+		delete pool;
+	}
 
 end:
+	brawshot_destroy(state.filter);
+
 	if(clip != nullptr) {
 		clip->Release();
 	}
 
+	return result;
+}
+
+// Preview renders get their own file names so they never overwrite the final
+// render of the same clip.
+static std::string PreviewName(const std::string& name)
+{
+	if(sample_stride == 1 && scale_factor == 1) {
+		return name;
+	}
+
+	size_t slash = name.rfind('/');
+	size_t dot = name.rfind('.');
+	if(single && dot != std::string::npos &&
+			(slash == std::string::npos || dot > slash)) {
+		return name.substr(0, dot) + "-preview" + name.substr(dot);
+	}
+
+	return name + "-preview";
+}
+
+static void AddBatchJob(const char* clip, const char* output)
+{
+	std::string prefix;
+	if(output != nullptr) {
+		prefix = output;
+	} else {
+		prefix = clip;
+		size_t len = prefix.size();
+		if(len > 5 && prefix.compare(len - 5, 5, ".braw") == 0) {
+			prefix.resize(len - 5);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(status_lock);
+	batch_jobs.push_back(BatchJob(clip, PreviewName(prefix)));
+}
+
+static void ReadJobList()
+{
+	FILE* f = fopen(batch_filename, "rt");
+	if(!f) {
+		printf("Error opening %s: %s\n", batch_filename,
+				strerror(errno));
+		exit(1);
+	}
+
+	// one job per line: clip.braw [output-prefix]
+	char line[1024];
+	while(fgets(line, sizeof(line), f)) {
+		char clip[512];
+		char output[512];
+		int n = sscanf(line, "%511s %511s", clip, output);
+		if(n < 1 || clip[0] == '#') {
+			continue;
+		}
+		AddBatchJob(clip, n > 1 ? output : nullptr);
+	}
+
+	fclose(f);
+}
+
+// Queues all clips in the watched directory whose size did not change since
+// the last scan, i.e. which are not being copied anymore.
+static void ScanWatchDir()
+{
+	static std::map<std::string, long long> pending;
+	static std::set<std::string> seen;
+
+	DIR* dir = opendir(watch_dir);
+	if(!dir) {
+		printf("Error opening %s: %s\n", watch_dir, strerror(errno));
+		exit(1);
+	}
+
+	struct dirent* entry;
+	while((entry = readdir(dir)) != nullptr) {
+		size_t len = strlen(entry->d_name);
+		if(len <= 5 || strcmp(entry->d_name + len - 5, ".braw")) {
+			continue;
+		}
+
+		std::string path = std::string(watch_dir) + "/" + entry->d_name;
+		if(seen.count(path)) {
+			continue;
+		}
+
+		struct stat st;
+		if(stat(path.c_str(), &st) != 0) {
+			continue;
+		}
+
+		auto it = pending.find(path);
+		if(it != pending.end() && it->second == st.st_size) {
+			pending.erase(it);
+			seen.insert(path);
+			AddBatchJob(path.c_str(), nullptr);
+		} else {
+			pending[path] = st.st_size;
+		}
+	}
+
+	closedir(dir);
+}
+
+// Runs a batch job with the given processor and records its outcome.
+static HRESULT RunBatchJob(IBlackmagicRaw* codec, size_t index,
+		VideoProcessor** processor, const char* lut_filename,
+		unsigned int window_size, float gain)
+{
+	std::string clip, output;
+	{
+		std::lock_guard<std::mutex> lock(status_lock);
+		BatchJob& job = batch_jobs[index];
+		job.state = "running";
+		clip = job.clip;
+		output = job.output;
+		WriteStatus();
+	}
+
+	printf("Processing %s\n", clip.c_str());
+
+	HRESULT result = ProcessFile(codec, clip.c_str(), output.c_str(),
+			index, processor, lut_filename, window_size, gain);
+
+	std::lock_guard<std::mutex> lock(status_lock);
+	if(result == S_OK) {
+		batch_jobs[index].state = "done";
+		batch_jobs[index].progress = 100;
+	} else {
+		batch_jobs[index].state = "failed";
+	}
+	WriteStatus();
+
+	if(concurrent_clips > 1) {
+		printf("%s %s\n", result == S_OK ? "Finished" : "Failed",
+				clip.c_str());
+	}
+
+	return result;
+}
+
+// Processes the batch jobs, up to concurrent_clips at a time, each with one
+// of the processors. Whenever all jobs are taken, the next worker which is
+// done reads the job list (or the watched directory) again, so that new jobs
+// start as soon as a slot is free.
+HRESULT ProcessBatch(IBlackmagicRaw* codec, VideoProcessor** processors,
+		const char* lut_filename, unsigned int window_size, float gain)
+{
+	HRESULT result = S_OK;
+	size_t next = 0;
+	bool scanned = false;
+
+	// a FIFO is reopened after every writer, which turns it into a queue
+	bool daemon = watch_dir != nullptr;
+	struct stat st;
+	if(batch_filename != nullptr && stat(batch_filename, &st) == 0 &&
+			S_ISFIFO(st.st_mode)) {
+		daemon = true;
+	}
+
+	// returns false once there are no more jobs
+	std::mutex scan_lock;
+	auto take = [&](size_t* index) {
+		std::lock_guard<std::mutex> guard(scan_lock);
+		while(true) {
+			{
+				std::lock_guard<std::mutex> lock(status_lock);
+				if(next < batch_jobs.size()) {
+					*index = next++;
+					return true;
+				}
+			}
+
+			if(scanned && !daemon) {
+				return false;
+			}
+
+			if(scanned && watch_dir != nullptr) {
+				std::this_thread::sleep_for(std::chrono::seconds(1));
+			}
+
+			if(batch_filename != nullptr) {
+				ReadJobList();
+			} else {
+				ScanWatchDir();
+			}
+			scanned = true;
+
+			std::lock_guard<std::mutex> lock(status_lock);
+			WriteStatus();
+		}
+	};
+
+	auto work = [&](unsigned int slot) {
+		size_t index;
+		while(take(&index)) {
+			HRESULT r = RunBatchJob(codec, index, &processors[slot],
+					lut_filename, window_size, gain);
+			if(r != S_OK) {
+				std::lock_guard<std::mutex> lock(status_lock);
+				result = r;
+			}
+		}
+	};
+
+	if(concurrent_clips == 1) {
+		work(0);
+		return result;
+	}
+
+	std::vector<std::thread> workers;
+	for(unsigned int i = 0; i < concurrent_clips; i++) {
+		workers.push_back(std::thread(work, i));
+	}
+	for(std::thread& worker : workers) {
+		worker.join();
+	}
+
+	codec->FlushJobs();
+
+	return result;
+}
+
+// Inserts the shard into a file name, before its extension, so that every
+// worker writes its own file.
+static std::string ShardName(const char* name, unsigned int shard)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-shard%uof%u", shard, shard_count);
+
+	std::string result = name;
+	size_t slash = result.rfind('/');
+	size_t dot = result.rfind('.');
+	if(dot == std::string::npos || dot == 0 ||
+			(slash != std::string::npos && dot <= slash + 1)) {
+		dot = result.size();
+	}
+
+	return result.insert(dot, suffix);
+}
+
+// Runs the same command line in shard_count worker processes, each with its
+// own EGL context, and waits for all of them. The statistics and metrics
+// files (and the metrics socket) get the shard in their names.
+static int RunShards(int argc, const char** argv)
+{
+	std::vector<pid_t> pids(shard_count);
+	char shard[32];
+	bool failed = false;
+
+	for(unsigned int i = 0; i < shard_count; i++) {
+		std::vector<const char*> args;
+		std::vector<std::string> names;
+		names.reserve(argc);
+		args.push_back(argv[0]);
+		for(int n = 1; n < argc; n++) {
+			if(!strcmp(argv[n], "--shards") && n + 1 < argc) {
+				n++;
+			} else if((!strcmp(argv[n], "--stats") ||
+						!strcmp(argv[n], "--metrics") ||
+						!strcmp(argv[n],
+							"--metrics-socket")) &&
+					n + 1 < argc) {
+				names.push_back(ShardName(argv[n + 1], i));
+				args.push_back(argv[n]);
+				args.push_back(names.back().c_str());
+				n++;
+			} else {
+				args.push_back(argv[n]);
+			}
+		}
+		snprintf(shard, sizeof(shard), "%u/%u", i, shard_count);
+		args.push_back("--shard");
+		args.push_back(shard);
+		args.push_back(nullptr);
+
+		char logname[256];
+		snprintf(logname, sizeof(logname), "%s-shard%u.log",
+				outputFileName, i);
+
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid < 0) {
+			printf("Error starting shard %u: %s\n", i,
+					strerror(errno));
+			failed = true;
+			break;
+		} else if(pid == 0) {
+			int fd = open(logname, O_WRONLY | O_CREAT | O_TRUNC,
+					0644);
+			if(fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				close(fd);
+			}
+			execv("/proc/self/exe", (char* const*) args.data());
+			printf("Error executing shard %u: %s\n", i,
+					strerror(errno));
+			_exit(127);
+		}
+
+		pids[i] = pid;
+		printf("Started shard %u/%u (pid %d, log %s)\n", i,
+				shard_count, pid, logname);
+	}
+
+	unsigned int running = 0;
+	for(unsigned int i = 0; i < shard_count; i++) {
+		if(pids[i] > 0) {
+			running++;
+		}
+	}
+
+	while(running > 0) {
+		int status;
+		pid_t pid = wait(&status);
+		if(pid < 0) {
+			break;
+		}
+
+		unsigned int i;
+		for(i = 0; i < shard_count && pids[i] != pid; i++);
+		if(i == shard_count) {
+			continue;
+		}
+		running--;
+
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			printf("Shard %u/%u finished (%u running)\n", i,
+					shard_count, running);
+		} else if(WIFSIGNALED(status)) {
+			printf("Shard %u/%u killed by signal %d (%u running)\n",
+					i, shard_count, WTERMSIG(status),
+					running);
+			failed = true;
+		} else {
+			printf("Shard %u/%u failed with exit code %d (%u running)\n",
+					i, shard_count, WEXITSTATUS(status),
+					running);
+			failed = true;
+		}
+	}
+
+	if(failed) {
+		printf("Some shards failed; rerun them with --shard i/%u\n",
+				shard_count);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, const char** argv)
+{
+	const int all_argc = argc;
+	const char** all_argv = argv;
+	const char* self = *argv;
+	const char* lut_filename = nullptr;
+	const char* clipName = nullptr;
+	const char* auto_gain_mode = nullptr;
+	const char* stream_path = "-";
+	bool stream_mode = false;
+	unsigned int window_size = 100;
+	float gain = 1.0f;
+	unsigned int coordinate = 0;
+
+	argc--;
+	argv++;
+
+	for(; argc; argc--, argv++) {
+		if(!strcmp(*argv, "-l") && argc > 1) {
+			lut_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-o") && argc > 1) {
+			outputFileName = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-i") && argc > 1) {
+			clipName = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-g") && argc > 1) {
+			gain = (float) atof(argv[1]);
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-r") && argc > 1) {
+			ref_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-L")) {
+			ref_after_lut = true;
+		} else if(!strcmp(*argv, "-s")) {
+			single = true;
+		} else if(!strcmp(*argv, "-R")) {
+			raw_dump = true;
+			single = true;
+		} else if(!strcmp(*argv, "--robust") && argc > 1) {
+			if(!strcmp(argv[1], "sigma")) {
+				robust_median = false;
+			} else if(!strcmp(argv[1], "median")) {
+				robust_median = true;
+			} else {
+				std::cerr << "Invalid robust stacking mode" << std::endl;
+				return 1;
+			}
+			robust = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--kappa") && argc > 1) {
+			robust_kappa = (float) atof(argv[1]);
+			if(robust_kappa <= 0) {
+				std::cerr << "Invalid kappa" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--auto-gain") && argc > 1) {
+			if(strcmp(argv[1], "static") && strcmp(argv[1], "smooth")) {
+				std::cerr << "Invalid auto gain mode" << std::endl;
+				return 1;
+			}
+			auto_gain_mode = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--gain-percentile") && argc > 1) {
+			gain_percentile = (float) atof(argv[1]);
+			if(gain_percentile <= 0 || gain_percentile > 100) {
+				std::cerr << "Invalid gain percentile" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--gain-target") && argc > 1) {
+			gain_target = (float) atof(argv[1]);
+			if(gain_target <= 0 || gain_target > 1) {
+				std::cerr << "Invalid gain target" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--stream") && argc > 1) {
+			if(!strcmp(argv[1], "y4m")) {
+				stream_format = STREAM_Y4M;
+			} else if(!strcmp(argv[1], "bgra")) {
+				stream_format = STREAM_BGRA;
+			} else if(!strcmp(argv[1], "rgb48")) {
+				stream_format = STREAM_RGB48;
+			} else {
+				std::cerr << "Invalid stream format" << std::endl;
+				return 1;
+			}
+			stream_mode = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--format") && argc > 1) {
+			if(!strcmp(argv[1], "jpg")) {
+				output_format = FORMAT_JPEG;
+			} else if(!strcmp(argv[1], "tiff")) {
+				output_format = FORMAT_TIFF;
+			} else if(!strcmp(argv[1], "png")) {
+				output_format = FORMAT_PNG;
+			} else if(!strcmp(argv[1], "exr")) {
+				output_format = FORMAT_EXR;
+			} else {
+				std::cerr << "Invalid output format" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--output-spec") && argc > 1) {
+			OutputSpec spec;
+			if(!parse_output_spec(argv[1], &spec)) {
+				std::cerr << "Invalid output spec" << std::endl;
+				return 1;
+			}
+			output_specs.push_back(spec);
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--compression") && argc > 1) {
+			char* end;
+			long level = strtol(argv[1], &end, 10);
+			if(*end || end == argv[1] || level < 0 || level > 9) {
+				std::cerr << "Invalid compression level" << std::endl;
+				return 1;
+			}
+			compression_level = (int) level;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--encoders") && argc > 1) {
+			int threads = atoi(argv[1]);
+			if(threads < 1) {
+				std::cerr << "Invalid number of encoder threads" << std::endl;
+				return 1;
+			}
+			encoder_threads = (unsigned int) threads;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--jobs") && argc > 1) {
+			int jobs = atoi(argv[1]);
+			if(jobs < 1) {
+				std::cerr << "Invalid number of decode jobs" << std::endl;
+				return 1;
+			}
+			decode_jobs = (unsigned int) jobs;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--autotune")) {
+			autotune = true;
+		} else if(!strcmp(*argv, "--tune-profile") && argc > 1) {
+			profile_filename = argv[1];
+			autotune = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--tune-memory") && argc > 1) {
+			int size = atoi(argv[1]);
+			if(size < 1) {
+				std::cerr << "Invalid memory budget" << std::endl;
+				return 1;
+			}
+			tune_memory = (size_t) size << 20;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--io") && argc > 1) {
+			if(!strcmp(argv[1], "uring")) {
+				use_uring = true;
+			} else if(!strcmp(argv[1], "threads")) {
+				use_uring = false;
+			} else {
+				std::cerr << "Invalid I/O mode" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--io-threads") && argc > 1) {
+			int threads = atoi(argv[1]);
+			if(threads < 1) {
+				std::cerr << "Invalid number of I/O threads" << std::endl;
+				return 1;
+			}
+			io_threads = (unsigned int) threads;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--fsync") && argc > 1) {
+			if(!strcmp(argv[1], "none")) {
+				fsync_policy = FSYNC_NONE;
+			} else if(!strcmp(argv[1], "file")) {
+				fsync_policy = FSYNC_FILE;
+			} else if(!strcmp(argv[1], "end")) {
+				fsync_policy = FSYNC_END;
+			} else {
+				std::cerr << "Invalid fsync policy" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--huge-pages") && argc > 1) {
+			if(!strcmp(argv[1], "off")) {
+				huge_pages = HUGE_PAGES_OFF;
+			} else if(!strcmp(argv[1], "thp")) {
+				huge_pages = HUGE_PAGES_TRANSPARENT;
+			} else if(!strcmp(argv[1], "explicit")) {
+				huge_pages = HUGE_PAGES_EXPLICIT;
+			} else {
+				std::cerr << "Invalid huge page mode" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--sdk-buffers")) {
+			sdk_buffers = true;
+		} else if(!strcmp(*argv, "--mlock")) {
+			lock_buffers = true;
+		} else if(!strcmp(*argv, "--direct-io")) {
+			direct_io = true;
+		} else if(!strcmp(*argv, "--mkv")) {
+			mkv = true;
+		} else if(!strcmp(*argv, "--stream-to") && argc > 1) {
+			stream_path = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--stats") && argc > 1) {
+			stats_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-d") && argc > 1) {
+			defects_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--find-defects") && argc > 1) {
+			clipName = argv[1];
+			find_defects = true;
+			stack_mode = true;
+			single = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--defect-sigma") && argc > 1) {
+			defect_sigma = (float) atof(argv[1]);
+			if(defect_sigma <= 0) {
+				std::cerr << "Invalid defect threshold" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--build-dark") && argc > 1) {
+			clipName = argv[1];
+			build_dark = true;
+			stack_mode = true;
+			raw_dump = true;
+			single = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--stack")) {
+			stack_mode = true;
+			single = true;
+		} else if(!strcmp(*argv, "--stack-jobs") && argc > 1) {
+			int jobs = atoi(argv[1]);
+			if(jobs < 1) {
+				std::cerr << "Invalid number of stacking jobs" << std::endl;
+				return 1;
+			}
+			stack_jobs = (unsigned int) jobs;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--checkpoint") && argc > 1) {
+			int interval = atoi(argv[1]);
+			if(interval < 0) {
+				std::cerr << "Invalid checkpoint interval" << std::endl;
+				return 1;
+			}
+			checkpoint_interval = (unsigned long) interval;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--resume")) {
+			resume = true;
+		} else if(!strcmp(*argv, "--shard") && argc > 1) {
+			if(sscanf(argv[1], "%u/%u", &shard_index,
+						&shard_count) != 2 ||
+					shard_index >= shard_count) {
+				std::cerr << "Invalid shard" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--shards") && argc > 1) {
+			int shards = atoi(argv[1]);
+			if(shards < 1) {
+				std::cerr << "Invalid shard count" << std::endl;
+				return 1;
+			}
+			coordinate = (unsigned int) shards;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--vram-budget") && argc > 1) {
+			int budget = atoi(argv[1]);
+			if(budget <= 0) {
+				std::cerr << "Invalid VRAM budget" << std::endl;
+				return 1;
+			}
+			vram_budget = (size_t) budget << 20;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--input-bits") && argc > 1) {
+			int bits = atoi(argv[1]);
+			if(bits < 1 || bits > 16) {
+				std::cerr << "Invalid number of input bits" << std::endl;
+				return 1;
+			}
+			input_bits = (unsigned int) bits;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--output-every") && argc > 1) {
+			int every = atoi(argv[1]);
+			if(every < 1) {
+				std::cerr << "Invalid output interval" << std::endl;
+				return 1;
+			}
+			output_every = (unsigned long) every;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--output-at") && argc > 1) {
+			if(!parse_output_list(argv[1])) {
+				std::cerr << "Invalid output frame list" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--sample-stride") && argc > 1) {
+			int stride = atoi(argv[1]);
+			if(stride < 1) {
+				std::cerr << "Invalid sample stride" << std::endl;
+				return 1;
+			}
+			sample_stride = (unsigned int) stride;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--scale") && argc > 1) {
+			if(!strcmp(argv[1], "full")) {
+				resolution_scale = blackmagicRawResolutionScaleFull;
+				scale_factor = 1;
+			} else if(!strcmp(argv[1], "half")) {
+				resolution_scale = blackmagicRawResolutionScaleHalf;
+				scale_factor = 2;
+			} else if(!strcmp(argv[1], "quarter")) {
+				resolution_scale = blackmagicRawResolutionScaleQuarter;
+				scale_factor = 4;
+			} else if(!strcmp(argv[1], "eighth")) {
+				resolution_scale = blackmagicRawResolutionScaleEighth;
+				scale_factor = 8;
+			} else {
+				std::cerr << "Invalid scale" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--crop") && argc > 1) {
+			if(sscanf(argv[1], "%u,%u,%u,%u", &crop_x, &crop_y,
+						&crop_width, &crop_height) != 4 ||
+					!crop_width || !crop_height) {
+				std::cerr << "Invalid crop" << std::endl;
+				return 1;
+			}
+			crop = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--batch") && argc > 1) {
+			batch_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--watch") && argc > 1) {
+			watch_dir = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--concurrent") && argc > 1) {
+			int clips = atoi(argv[1]);
+			if(clips < 1) {
+				std::cerr << "Invalid number of concurrent clips" << std::endl;
+				return 1;
+			}
+			concurrent_clips = (unsigned int) clips;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--verify")) {
+			verify = true;
+		} else if(!strcmp(*argv, "--verify-baseline") && argc > 1) {
+			verify_baseline = argv[1];
+			verify = true;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--verify-threshold") && argc > 1) {
+			verify_threshold = (float) atof(argv[1]);
+			if(verify_threshold <= 0 || verify_threshold >= 100) {
+				std::cerr << "Invalid threshold" << std::endl;
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--metrics") && argc > 1) {
+			metrics_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--metrics-socket") && argc > 1) {
+			metrics_socket = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--metrics-interval") && argc > 1) {
+			int interval = atoi(argv[1]);
+			if(interval < 1) {
+				std::cerr << "Invalid metrics interval" << std::endl;
+				return 1;
+			}
+			metrics_interval = (unsigned int) interval;
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--status") && argc > 1) {
+			status_filename = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "-w") && argc > 1) {
+			int win = atoi(argv[1]);
+			if(win < 0) {
+				std::cerr << "Invalid window size" << std::endl;
+				return 1;
+			}
+			window_size = (unsigned int) win;
+			argc--;
+			argv++;
+		} else {
+			std::cerr << "Usage: " << self << " -i clip.braw [-o image.bmp]" << std::endl;
+			return 1;
+		}
+	}
+
+	if(verify) {
+		return run_verify(verify_baseline, verify_threshold) ? 0 : 1;
+	}
+
+	bool batch = batch_filename != nullptr || watch_dir != nullptr;
+	if(batch_filename != nullptr && watch_dir != nullptr) {
+		std::cerr << "--batch and --watch are mutually exclusive" << std::endl;
+		return 1;
+	}
+
+	if(clipName == nullptr && !batch) {
+		std::cerr << "Missing clip name" << std::endl;
+		return 1;
+	}
+
+	if(clipName != nullptr && batch) {
+		std::cerr << "-i cannot be combined with --batch or --watch" << std::endl;
+		return 1;
+	}
+
+	// the gain, statistics, tuning and container are shared by the run
+	if(concurrent_clips > 1 && (!batch || auto_gain_mode != nullptr ||
+				stats_filename != nullptr || autotune ||
+				mkv)) {
+		std::cerr << "--concurrent requires batch mode and cannot be combined with --auto-gain, --stats, --autotune or --mkv" << std::endl;
+		return 1;
+	}
+
+	if(crop && scale_factor > 1) {
+		// the crop is specified in full resolution pixels
+		crop_x /= scale_factor;
+		crop_y /= scale_factor;
+		crop_width /= scale_factor;
+		crop_height /= scale_factor;
+		if(!crop_width || !crop_height) {
+			std::cerr << "The crop is too small for this scale" << std::endl;
+			return 1;
+		}
+	}
+
+	std::string output_name = PreviewName(outputFileName);
+	outputFileName = output_name.c_str();
+
+	for(OutputSpec& spec : output_specs) {
+		spec.prefix = PreviewName(spec.prefix);
+	}
+
+	if(!output_specs.empty() && (stack_mode || batch)) {
+		std::cerr << "--output-spec cannot be combined with --stack, --build-dark, --find-defects or batch mode" << std::endl;
+		return 1;
+	}
+
+	if(stream_mode && (batch || coordinate || shard_count || resume ||
+				find_defects || build_dark)) {
+		std::cerr << "--stream cannot be combined with batch mode, sharding, --resume, --find-defects or --build-dark" << std::endl;
+		return 1;
+	}
+
+	if(mkv && (stream_mode || raw_dump || coordinate || shard_count ||
+				resume || find_defects || build_dark)) {
+		std::cerr << "--mkv only supports JPEG output without sharding or --resume" << std::endl;
+		return 1;
+	}
+
+	if(output_format != FORMAT_JPEG && (raw_dump || stream_mode || mkv)) {
+		std::cerr << "--format cannot be combined with -R, --stream or --mkv" << std::endl;
+		return 1;
+	}
+
+	// the output specs are always encoded on the pool
+	if(output_format != FORMAT_JPEG || !output_specs.empty()) {
+		if(encoder_threads == 0) {
+			encoder_threads = std::thread::hardware_concurrency();
+		}
+		encoders = new EncoderPool(encoder_threads ?
+				encoder_threads : 1);
+	}
+
+	if(stream_mode && raw_dump && stream_format != STREAM_RGB48) {
+		std::cerr << "-R can only be streamed as rgb48" << std::endl;
+		return 1;
+	}
+
+	if(stream_mode) {
+		if(stream_format == STREAM_RGB48) {
+			raw_dump = true;
+		}
+
+		if(!strcmp(stream_path, "-")) {
+			// the stream gets the real stdout, all messages go to
+			// stderr instead
+			stream_fd = dup(STDOUT_FILENO);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+		} else {
+			stream_fd = open(stream_path, O_WRONLY | O_CREAT |
+					O_TRUNC, 0644);
+		}
+
+		if(stream_fd < 0) {
+			std::cerr << "Error opening the stream: " << strerror(errno) << std::endl;
+			return 1;
+		}
+
+		// a closed pipe is reported by the stream writer
+		signal(SIGPIPE, SIG_IGN);
+	}
+
+	if(auto_gain_mode != nullptr && (coordinate || shard_count || resume)) {
+		std::cerr << "--auto-gain depends on all previous frames and cannot be used with --shards or --resume" << std::endl;
+		return 1;
+	}
+
+	if(auto_gain_mode != nullptr) {
+		auto_gain = new AutoGain(!strcmp(auto_gain_mode, "smooth"),
+				gain_percentile, gain_target);
+	}
+
+	// with --shards, only the workers write statistics
+	if(stats_filename != nullptr && !coordinate) {
+		stats_file = fopen(stats_filename, "wt");
+		if(!stats_file) {
+			printf("Error creating %s: %s\n", stats_filename,
+					strerror(errno));
+			return 1;
+		}
+		fprintf(stats_file, "frame,gain,r_p1,g_p1,b_p1,r_p50,g_p50,b_p50,"
+				"r_p%g,g_p%g,b_p%g\n", gain_percentile,
+				gain_percentile, gain_percentile);
+	}
+
+	if(find_defects && build_dark) {
+		std::cerr << "--find-defects and --build-dark are mutually exclusive" << std::endl;
+		return 1;
+	}
+
+	if(defects_filename != nullptr) {
+		defect_map = new DefectMap();
+		if(!defect_map->load(defects_filename)) {
+			return 1;
+		}
+		printf("Loaded %u defective pixels\n", defect_map->get_count());
+	}
+
+	if(build_dark && ref_filename != nullptr) {
+		std::cerr << "A dark frame cannot be built with a reference frame" << std::endl;
+		return 1;
+	}
+
+	if(robust && stack_mode) {
+		std::cerr << "--robust and --stack are mutually exclusive" << std::endl;
+		return 1;
+	}
+
+	if(robust && (checkpoint_interval || resume)) {
+		std::cerr << "Checkpoints are not supported with --robust" << std::endl;
+		return 1;
+	}
+
+	if(stack_mode && (checkpoint_interval || resume)) {
+		std::cerr << "Checkpoints are not supported with --stack" << std::endl;
+		return 1;
+	}
+
+	if((coordinate || shard_count) && batch) {
+		std::cerr << "Sharding is not supported in batch mode" << std::endl;
+		return 1;
+	}
+
+	if((coordinate || shard_count) && single) {
+		std::cerr << "Sharding is not supported for single image output" << std::endl;
+		return 1;
+	}
+
+	if(coordinate) {
+		if(shard_count) {
+			std::cerr << "--shards and --shard are mutually exclusive" << std::endl;
+			return 1;
+		}
+		shard_count = coordinate;
+		return RunShards(all_argc, all_argv);
+	}
+
+	writer = new FileWriter(use_uring, io_threads, fsync_policy, direct_io,
+			&metrics);
+	if(use_uring && !writer->using_uring()) {
+		printf("io_uring is not available, writing with %u threads\n",
+				io_threads);
+	}
+
+	if(metrics_filename != nullptr || metrics_socket != nullptr) {
+		exporter = new MetricsExporter(&metrics, metrics_filename,
+				metrics_socket, metrics_interval, SampleQueues);
+	}
+
+	HRESULT result = S_OK;
+
+	IBlackmagicRawFactory* factory = nullptr;
+	IBlackmagicRaw* codec = nullptr;
+	std::vector<VideoProcessor*> processors(concurrent_clips, nullptr);
+
+	CameraCodecCallback callback;
+	PooledResourceManager resource_manager(huge_pages, lock_buffers);
+
+	factory = CreateBlackmagicRawFactoryInstanceFromPath(BRAWSDK_ROOT "/Libraries/");
+	if(factory == nullptr) {
+		std::cerr << "Failed to create IBlackmagicRawFactory!" << std::endl;
+		goto end;
+	}
+
+	result = factory->CreateCodec(&codec);
+	if(result != S_OK) {
+		std::cerr << "Failed to create IBlackmagicRaw!" << std::endl;
+		goto end;
+	}
+
+	result = codec->SetCallback(&callback);
+	if(result != S_OK) {
+		std::cerr << "Failed to set IBlackmagicRawCallback!" << std::endl;
+		goto end;
+	}
+
+	// the decoded frames land in pooled buffers, which are uploaded as is
+	if(!sdk_buffers && !resource_manager.install(codec)) {
+		printf("Cannot replace the resource manager, using the SDK's buffers\n");
+	}
+
+	if(batch) {
+		result = ProcessBatch(codec, processors.data(), lut_filename,
+				window_size, gain);
+	} else {
+		result = ProcessFile(codec, clipName, outputFileName, -1,
+				&processors[0], lut_filename, window_size,
+				gain);
+	}
+
+end:
+	// the shaders and LUTs of the group belong to its first processor
+	for(VideoProcessor* processor : processors) {
+		if(processor != processor_group) {
+			delete processor;
+		}
+	}
+	if(processor_group != nullptr) {
+		delete processor_group;
+	}
+
+	if(defect_map != nullptr) {
+		delete defect_map;
+	}
+
+	if(auto_gain != nullptr) {
+		delete auto_gain;
+	}
+
+	if(stats_file != nullptr) {
+		fclose(stats_file);
+	}
+
+	if(encoders != nullptr) {
+		delete encoders;
+		encoders = nullptr;
+	}
+
+	if(writer != nullptr) {
+		// waits for the remaining files
+		delete writer;
+		writer = nullptr;
+	}
+
+	if(exporter != nullptr) {
+		// exports the final counters
+		delete exporter;
+	}
+
+	if(stream_fd >= 0) {
+		close(stream_fd);
+	}
+
 	if(codec != nullptr) {
 		codec->Release();
 	}
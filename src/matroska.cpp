@@ -0,0 +1,375 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+
+#include "matroska.h"
+
+// element IDs
+#define	EBML			0x1A45DFA3
+#define	EBML_VERSION		0x4286
+#define	EBML_READ_VERSION	0x42F7
+#define	EBML_MAX_ID_LENGTH	0x42F2
+#define	EBML_MAX_SIZE_LENGTH	0x42F3
+#define	DOCTYPE			0x4282
+#define	DOCTYPE_VERSION		0x4287
+#define	DOCTYPE_READ_VERSION	0x4285
+#define	SEGMENT			0x18538067
+#define	SEEK_HEAD		0x114D9B74
+#define	SEEK			0x4DBB
+#define	SEEK_ID			0x53AB
+#define	SEEK_POSITION		0x53AC
+#define	INFO			0x1549A966
+#define	TIMECODE_SCALE		0x2AD7B1
+#define	DURATION		0x4489
+#define	MUXING_APP		0x4D80
+#define	WRITING_APP		0x5741
+#define	TRACKS			0x1654AE6B
+#define	TRACK_ENTRY		0xAE
+#define	TRACK_NUMBER		0xD7
+#define	TRACK_UID		0x73C5
+#define	TRACK_TYPE		0x83
+#define	FLAG_LACING		0x9C
+#define	DEFAULT_DURATION	0x23E383
+#define	CODEC_ID		0x86
+#define	VIDEO			0xE0
+#define	PIXEL_WIDTH		0xB0
+#define	PIXEL_HEIGHT		0xBA
+#define	CLUSTER			0x1F43B675
+#define	TIMECODE		0xE7
+#define	SIMPLE_BLOCK		0xA3
+#define	CUES			0x1C53BB6B
+#define	CUE_POINT		0xBB
+#define	CUE_TIME		0xB3
+#define	CUE_TRACK_POSITIONS	0xB7
+#define	CUE_TRACK		0xF7
+#define	CUE_CLUSTER_POSITION	0xF1
+
+// timestamps in milliseconds
+#define	TIMESCALE		1000000
+
+// a cluster is written once it reaches this size or duration
+#define	CLUSTER_SIZE		(32 << 20)
+#define	CLUSTER_DURATION	30000
+
+typedef std::vector<uint8_t> Buffer;
+
+static void put_be(Buffer& b, uint64_t value, int bytes)
+{
+	for(int i = bytes - 1; i >= 0; i--) {
+		b.push_back(value >> (i * 8));
+	}
+}
+
+static void put_id(Buffer& b, uint32_t id)
+{
+	put_be(b, id, id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1);
+}
+
+// EBML variable length size; fixed to length bytes if given
+static void put_size(Buffer& b, uint64_t size, int length = 0)
+{
+	if(length == 0) {
+		length = 1;
+		while(length < 8 && size >= (1ULL << (7 * length)) - 1) {
+			length++;
+		}
+	}
+
+	put_be(b, size | (1ULL << (7 * length)), length);
+}
+
+static void put_uint(Buffer& b, uint32_t id, uint64_t value, int bytes = 0)
+{
+	if(bytes == 0) {
+		bytes = 1;
+		while(bytes < 8 && value >= (1ULL << (8 * bytes))) {
+			bytes++;
+		}
+	}
+
+	put_id(b, id);
+	put_size(b, bytes);
+	put_be(b, value, bytes);
+}
+
+static void put_float(Buffer& b, uint32_t id, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	put_id(b, id);
+	put_size(b, 8);
+	put_be(b, bits, 8);
+}
+
+static void put_string(Buffer& b, uint32_t id, const char* s)
+{
+	size_t length = strlen(s);
+	put_id(b, id);
+	put_size(b, length);
+	b.insert(b.end(), s, s + length);
+}
+
+static void put_master(Buffer& b, uint32_t id, const Buffer& children)
+{
+	put_id(b, id);
+	put_size(b, children.size());
+	b.insert(b.end(), children.begin(), children.end());
+}
+
+static void put_seek(Buffer& b, uint32_t id, uint64_t position)
+{
+	Buffer seek;
+	Buffer seek_id;
+	put_id(seek_id, id);
+
+	put_id(seek, SEEK_ID);
+	put_size(seek, seek_id.size());
+	seek.insert(seek.end(), seek_id.begin(), seek_id.end());
+	put_uint(seek, SEEK_POSITION, position, 8);
+
+	put_master(b, SEEK, seek);
+}
+
+MatroskaWriter::MatroskaWriter(const char* filename, unsigned int width,
+		unsigned int height, float fps)
+	: fps(fps), cluster_time(0), last_time(0), empty(true)
+{
+	this->filename = strdup(filename);
+
+	char tmpname[256];
+	snprintf(tmpname, sizeof(tmpname), "%s.part", filename);
+	file = fopen(tmpname, "wb");
+	if(!file) {
+		printf("Error creating %s: %s\n", tmpname, strerror(errno));
+		exit(1);
+	}
+	setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+	Buffer b;
+
+	Buffer ebml;
+	put_uint(ebml, EBML_VERSION, 1);
+	put_uint(ebml, EBML_READ_VERSION, 1);
+	put_uint(ebml, EBML_MAX_ID_LENGTH, 4);
+	put_uint(ebml, EBML_MAX_SIZE_LENGTH, 8);
+	put_string(ebml, DOCTYPE, "matroska");
+	put_uint(ebml, DOCTYPE_VERSION, 4);
+	put_uint(ebml, DOCTYPE_READ_VERSION, 2);
+	put_master(b, EBML, ebml);
+
+	// the segment size is only known at the end
+	put_id(b, SEGMENT);
+	segment_size_pos = b.size();
+	put_size(b, 0, 8);
+	segment_start = b.size();
+
+	Buffer info;
+	put_uint(info, TIMECODE_SCALE, TIMESCALE);
+	put_string(info, MUXING_APP, "brawshot");
+	put_string(info, WRITING_APP, "brawshot");
+	size_t duration_offset = info.size();
+	put_float(info, DURATION, 0);
+
+	Buffer video;
+	put_uint(video, PIXEL_WIDTH, width);
+	put_uint(video, PIXEL_HEIGHT, height);
+
+	Buffer track;
+	put_uint(track, TRACK_NUMBER, 1);
+	put_uint(track, TRACK_UID, 1);
+	put_uint(track, TRACK_TYPE, 1);
+	put_uint(track, FLAG_LACING, 0);
+	put_uint(track, DEFAULT_DURATION, (uint64_t) llround(1e9 / fps));
+	put_string(track, CODEC_ID, "V_MJPEG");
+	put_master(track, VIDEO, video);
+
+	Buffer tracks;
+	put_master(tracks, TRACK_ENTRY, track);
+
+	Buffer info_element;
+	put_master(info_element, INFO, info);
+	Buffer tracks_element;
+	put_master(tracks_element, TRACKS, tracks);
+
+	// seek head with fixed size positions, the one of the cues is patched
+	// in close()
+	Buffer seek_head;
+	put_seek(seek_head, INFO, 0);
+	put_seek(seek_head, TRACKS, 0);
+	put_seek(seek_head, CUES, 0);
+
+	Buffer head;
+	put_master(head, SEEK_HEAD, seek_head);
+	uint64_t info_pos = head.size();
+	uint64_t tracks_pos = info_pos + info_element.size();
+
+	seek_head.clear();
+	put_seek(seek_head, INFO, info_pos);
+	put_seek(seek_head, TRACKS, tracks_pos);
+	put_seek(seek_head, CUES, 0);
+
+	head.clear();
+	put_master(head, SEEK_HEAD, seek_head);
+
+	// the value of the last seek position is at the end of the seek head,
+	// the value of the duration follows its ID and size
+	cues_seek_pos = segment_start + head.size() - 8;
+	duration_pos = segment_start + info_pos + info_element.size() -
+		info.size() + duration_offset + 3;
+
+	head.insert(head.end(), info_element.begin(), info_element.end());
+	head.insert(head.end(), tracks_element.begin(), tracks_element.end());
+
+	b.insert(b.end(), head.begin(), head.end());
+	fwrite(b.data(), b.size(), 1, file);
+}
+
+MatroskaWriter::~MatroskaWriter()
+{
+	if(file != nullptr) {
+		close();
+	}
+	free(filename);
+}
+
+uint64_t MatroskaWriter::timestamp(unsigned long index)
+{
+	return (uint64_t) llround(index * 1000.0 / fps);
+}
+
+// Reserves the place of an output frame in the file. Frames which are
+// reserved are written in this order, even if their encoding finishes in a
+// different order.
+void MatroskaWriter::reserve(unsigned long index)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	order.push_back(index);
+}
+
+// Appends a JPEG frame; index is the output frame number.
+void MatroskaWriter::write(const void* data, size_t size, unsigned long index)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [this, index] {
+		return order.empty() || order.front() == index;
+	});
+
+	uint64_t time = timestamp(index);
+
+	if(!empty && (cluster.size() + size > CLUSTER_SIZE ||
+				time - cluster_time > CLUSTER_DURATION)) {
+		flush();
+	}
+
+	if(empty) {
+		cluster_time = time;
+		empty = false;
+	}
+
+	int16_t relative = time - cluster_time;
+
+	put_id(cluster, SIMPLE_BLOCK);
+	put_size(cluster, size + 4);
+	cluster.push_back(0x81);	// track 1
+	cluster.push_back((uint16_t) relative >> 8);
+	cluster.push_back((uint16_t) relative & 0xFF);
+	cluster.push_back(0x80);	// keyframe
+	const uint8_t* bytes = (const uint8_t*) data;
+	cluster.insert(cluster.end(), bytes, bytes + size);
+
+	last_time = time;
+
+	if(!order.empty()) {
+		order.pop_front();
+	}
+	guard.unlock();
+	cv.notify_all();
+}
+
+// Writes the current cluster with a single write.
+void MatroskaWriter::flush()
+{
+	if(empty) {
+		return;
+	}
+
+	CuePoint cue;
+	cue.time = cluster_time;
+	cue.position = ftello(file) - segment_start;
+	cues.push_back(cue);
+
+	Buffer header;
+	put_id(header, CLUSTER);
+	Buffer timecode;
+	put_uint(timecode, TIMECODE, cluster_time);
+	put_size(header, timecode.size() + cluster.size());
+	header.insert(header.end(), timecode.begin(), timecode.end());
+
+	fwrite(header.data(), header.size(), 1, file);
+	fwrite(cluster.data(), cluster.size(), 1, file);
+
+	cluster.clear();
+	empty = true;
+}
+
+void MatroskaWriter::write_at(uint64_t position, const void* data,
+		size_t size)
+{
+	fseeko(file, position, SEEK_SET);
+	fwrite(data, size, 1, file);
+}
+
+// Writes the index, fixes up the header and renames the file.
+void MatroskaWriter::close()
+{
+	flush();
+
+	uint64_t cues_pos = ftello(file) - segment_start;
+
+	Buffer points;
+	for(const CuePoint& cue : cues) {
+		Buffer positions;
+		put_uint(positions, CUE_TRACK, 1);
+		put_uint(positions, CUE_CLUSTER_POSITION, cue.position);
+
+		Buffer point;
+		put_uint(point, CUE_TIME, cue.time);
+		put_master(point, CUE_TRACK_POSITIONS, positions);
+
+		put_master(points, CUE_POINT, point);
+	}
+
+	Buffer b;
+	put_master(b, CUES, points);
+	fwrite(b.data(), b.size(), 1, file);
+
+	uint64_t end = ftello(file);
+
+	b.clear();
+	put_size(b, end - segment_start, 8);
+	write_at(segment_size_pos, b.data(), b.size());
+
+	b.clear();
+	put_be(b, cues_pos, 8);
+	write_at(cues_seek_pos, b.data(), b.size());
+
+	double duration = cues.empty() ? 0 : last_time + 1000.0 / fps;
+	uint64_t bits;
+	memcpy(&bits, &duration, sizeof(bits));
+	b.clear();
+	put_be(b, bits, 8);
+	write_at(duration_pos, b.data(), b.size());
+
+	fclose(file);
+	file = nullptr;
+
+	char tmpname[256];
+	snprintf(tmpname, sizeof(tmpname), "%s.part", filename);
+	if(rename(tmpname, filename) != 0) {
+		printf("Error renaming %s: %s\n", tmpname, strerror(errno));
+	}
+}
@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+// how often the socket is polled, and how fast the exporter stops
+#define	METRICS_POLL_MS	100
+
+Metrics::Metrics()
+	: decoded(0), accumulated(0), encoded(0), written(0),
+		bytes_written(0), clip_frames(0), clip_done(0),
+		decode_queue(0), apply_queue(0), encode_queue(0),
+		write_queue(0), gpu_memory(0)
+{
+}
+
+static uint64_t resident_memory()
+{
+	unsigned long size, resident = 0;
+
+	FILE* f = fopen("/proc/self/statm", "rt");
+	if(!f) {
+		return 0;
+	}
+	if(fscanf(f, "%lu %lu", &size, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(f);
+
+	return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+MetricsExporter::MetricsExporter(Metrics* metrics, const char* filename,
+		const char* socket_path, unsigned int interval,
+		const std::function<void()>& sample)
+	: metrics(metrics), filename(filename), socket_path(socket_path),
+		interval(interval), sample(sample), listen_fd(-1),
+		last(std::chrono::steady_clock::now()),
+		last_accumulated(0), fps(0), done(false)
+{
+	size_t length = filename ? strlen(filename) : 0;
+	json = length >= 5 && !strcmp(filename + length - 5, ".json");
+
+	if(socket_path != nullptr) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+		// a stale socket of an earlier run
+		unlink(socket_path);
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(listen_fd < 0 ||
+				bind(listen_fd, (struct sockaddr*) &addr,
+					sizeof(addr)) != 0 ||
+				listen(listen_fd, 4) != 0) {
+			printf("Error creating %s: %s\n", socket_path,
+					strerror(errno));
+			if(listen_fd >= 0) {
+				close(listen_fd);
+				listen_fd = -1;
+			}
+		}
+	}
+
+	thread = std::thread(&MetricsExporter::run, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+	thread.join();
+
+	// the final counters
+	update();
+
+	if(listen_fd >= 0) {
+		close(listen_fd);
+		unlink(socket_path);
+	}
+}
+
+void MetricsExporter::run()
+{
+	std::chrono::steady_clock::time_point next =
+		std::chrono::steady_clock::now();
+
+	while(true) {
+		if(listen_fd >= 0) {
+			struct pollfd pfd = { listen_fd, POLLIN, 0 };
+			if(poll(&pfd, 1, METRICS_POLL_MS) > 0) {
+				serve();
+			}
+		} else {
+			std::unique_lock<std::mutex> guard(lock);
+			cv.wait_for(guard, std::chrono::milliseconds(
+						METRICS_POLL_MS), [this] {
+				return done;
+			});
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if(done) {
+				break;
+			}
+		}
+
+		std::chrono::steady_clock::time_point now =
+			std::chrono::steady_clock::now();
+		if(now >= next) {
+			update();
+			next = now + std::chrono::seconds(interval);
+		}
+	}
+}
+
+// Samples the queues, updates the frame rate and rewrites the file.
+void MetricsExporter::update()
+{
+	std::chrono::steady_clock::time_point now =
+		std::chrono::steady_clock::now();
+	std::chrono::duration<float> seconds = now - last;
+	uint64_t accumulated = metrics->accumulated;
+
+	if(seconds.count() > 0) {
+		float rate = (accumulated - last_accumulated) / seconds.count();
+		fps = fps == 0 ? rate : 0.7f * fps + 0.3f * rate;
+	}
+	last = now;
+	last_accumulated = accumulated;
+
+	if(filename == nullptr) {
+		return;
+	}
+
+	std::string text = format();
+
+	// the scraper must never see a partial file
+	std::string tmpname = std::string(filename) + ".part";
+	FILE* f = fopen(tmpname.c_str(), "wt");
+	if(!f) {
+		printf("Error creating %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+		return;
+	}
+	fwrite(text.data(), text.size(), 1, f);
+	fclose(f);
+
+	if(rename(tmpname.c_str(), filename) != 0) {
+		printf("Error renaming %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+	}
+}
+
+std::string MetricsExporter::format()
+{
+	if(sample) {
+		sample();
+	}
+
+	uint64_t frames = metrics->clip_frames;
+	uint64_t frames_done = metrics->clip_done;
+	float eta = fps > 0 && frames > frames_done ?
+		(frames - frames_done) / fps : 0;
+
+	struct Value {
+		const char*	name;
+		const char*	type;
+		const char*	help;
+		double		value;
+	} values[] = {
+		{ "frames_decoded_total", "counter", "Frames decoded by the SDK.",
+			(double) metrics->decoded },
+		{ "frames_accumulated_total", "counter",
+			"Frames added to the accumulator.",
+			(double) metrics->accumulated },
+		{ "frames_encoded_total", "counter", "Output frames encoded.",
+			(double) metrics->encoded },
+		{ "frames_written_total", "counter", "Output frames written.",
+			(double) metrics->written },
+		{ "bytes_written_total", "counter", "Bytes of output written.",
+			(double) metrics->bytes_written },
+		{ "decode_queue", "gauge", "Decode jobs in flight.",
+			(double) metrics->decode_queue },
+		{ "apply_queue", "gauge",
+			"Decoded frames waiting to be accumulated.",
+			(double) metrics->apply_queue },
+		{ "encode_queue", "gauge", "Output frames waiting for an encoder.",
+			(double) metrics->encode_queue },
+		{ "write_queue", "gauge", "Output files waiting to be written.",
+			(double) metrics->write_queue },
+		{ "fps", "gauge", "Frames accumulated per second.", fps },
+		{ "eta_seconds", "gauge", "Estimated time left for the clips.",
+			eta },
+		{ "clip_frames", "gauge", "Frames of the clips in progress.",
+			(double) frames },
+		{ "clip_frames_done", "gauge",
+			"Frames of the clips in progress which are accumulated.",
+			(double) frames_done },
+		{ "resident_memory_bytes", "gauge", "Resident memory.",
+			(double) resident_memory() },
+		{ "gpu_memory_bytes", "gauge", "Texture memory of the clips in progress.",
+			(double) metrics->gpu_memory }
+	};
+
+	std::string text = json ? "{" : "";
+	char line[512];
+	for(const Value& value : values) {
+		if(json) {
+			snprintf(line, sizeof(line), "%s\n\t\"%s\": %.10g",
+					text.size() > 1 ? "," : "",
+					value.name, value.value);
+		} else {
+			snprintf(line, sizeof(line),
+					"# HELP brawshot_%s %s\n"
+					"# TYPE brawshot_%s %s\n"
+					"brawshot_%s %.10g\n",
+					value.name, value.help, value.name,
+					value.type, value.name, value.value);
+		}
+		text += line;
+	}
+	if(json) {
+		text += "\n}\n";
+	}
+
+	return text;
+}
+
+// Answers a single HTTP request with the current metrics.
+void MetricsExporter::serve()
+{
+	int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+	if(fd < 0) {
+		return;
+	}
+
+	// the request itself does not matter, but it has to be read
+	char request[1024];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	if(poll(&pfd, 1, METRICS_POLL_MS) > 0) {
+		if(read(fd, request, sizeof(request)) < 0) {
+			close(fd);
+			return;
+		}
+	}
+
+	std::string body = format();
+	char header[256];
+	snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n", json ? "application/json" :
+			"text/plain; version=0.0.4", body.size());
+
+	std::string response = header + body;
+	size_t offset = 0;
+	while(offset < response.size()) {
+		ssize_t n = send(fd, response.data() + offset,
+				response.size() - offset, MSG_NOSIGNAL);
+		if(n <= 0) {
+			break;
+		}
+		offset += n;
+	}
+
+	close(fd);
+}
@@ -6,6 +6,7 @@
 #include <EGL/egl.h>
 
 #include "brawshot.h"
+#include "reference.h"
 
 extern "C" {
 	extern const char accumulate_vert[];
@@ -16,6 +17,12 @@ extern "C" {
 
 	extern const char output_raw_vert[];
 	extern const char output_raw_frag[];
+
+	extern const char robust_vert[];
+	extern const char robust_frag[];
+
+	extern const char histogram_vert[];
+	extern const char histogram_frag[];
 }
 
 static const float quad_vertices[] = {
@@ -30,6 +37,10 @@ static const float quad_vertices[] = {
 
 #define	QUAD_VTX_CNT	(sizeof(quad_vertices) / (sizeof(*quad_vertices) * 3))
 
+// the histogram samples about this many pixels per frame, which keeps the
+// float bins exact
+#define	HISTOGRAM_SAMPLES	(1 << 20)
+
 #ifdef NDEBUG
 #define GL_ERROR()
 #else
@@ -69,120 +80,99 @@ static void check_error(const char* filename, unsigned int line)
 }
 #endif
 
-VideoProcessor::VideoProcessor(unsigned int width, unsigned int height,
-				float gain, const char* lut_filename)
-	: width(width), height(height), samples(0), gain(gain), use_ref(false),
-			ref_after_lut(false), lut(nullptr),
-			accumulate_shader(nullptr), output_shader(nullptr),
-			current_accumulator(false)
+static void setup_texture(GLuint tex, GLint internalformat, GLsizei width,
+		GLsizei height, GLenum format, GLenum type)
 {
-	memset(ref_mean, 0, sizeof(ref_mean));
-
-	egl.make_current();
-
-	// create input (video frame) texture
-	glGenTextures(1, &input_tex);
-	glBindTexture(GL_TEXTURE_2D, input_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	GL_ERROR();
-
-	// create accumulation textures
-	glGenTextures(1, &accumulation_1_tex);
-	glBindTexture(GL_TEXTURE_2D, accumulation_1_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32UI, width, height, 0,
-			GL_RGB_INTEGER, GL_UNSIGNED_INT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	GL_ERROR();
-
-	glGenTextures(1, &accumulation_2_tex);
-	glBindTexture(GL_TEXTURE_2D, accumulation_2_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32UI, width, height, 0,
-			GL_RGB_INTEGER, GL_UNSIGNED_INT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	GL_ERROR();
-
-	// create black reference frame texture
-	glGenTextures(1, &input_ref_tex);
-	glBindTexture(GL_TEXTURE_2D, input_ref_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	GL_ERROR();
-
-	// create output texture
-	glGenTextures(1, &output_tex);
-	glBindTexture(GL_TEXTURE_2D, output_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA,
-			GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	GL_ERROR();
-
-	// create RAW output texture
-	glGenTextures(1, &output_raw_tex);
-	glBindTexture(GL_TEXTURE_2D, output_raw_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, NULL);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalformat, width, height, 0, format,
+			type, NULL);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	GL_ERROR();
+}
 
-	// load LUT
-	if(lut_filename != nullptr) {
-		lut = new LUT(lut_filename);
-		lut_tex = lut->create_texture();
-	}
+static void setup_texture_array(GLuint tex, GLint internalformat,
+		GLsizei width, GLsizei height, GLsizei layers, GLenum format,
+		GLenum type)
+{
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalformat, width, height,
+			layers, 0, format, type, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	GL_ERROR();
+}
 
-	// create accumulation framebuffer 1
-	glGenFramebuffers(1, &accumulation_1_fb);
-	glBindFramebuffer(GL_FRAMEBUFFER, accumulation_1_fb);
+static void setup_framebuffer(GLuint fb, GLuint tex)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, accumulation_1_tex, 0);
+			GL_TEXTURE_2D, tex, 0);
 	GL_ERROR();
 	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
 		printf("Error configuring framebuffer\n");
 		exit(1);
 	}
+}
 
-	// create accumulation framebuffer 2
-	glGenFramebuffers(1, &accumulation_2_fb);
-	glBindFramebuffer(GL_FRAMEBUFFER, accumulation_2_fb);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, accumulation_2_tex, 0);
-	GL_ERROR();
-	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		printf("Error configuring framebuffer\n");
-		exit(1);
-	}
+VideoProcessor::VideoProcessor(unsigned int width, unsigned int height,
+				float gain, const char* lut_filename,
+				unsigned int tile_height, VideoProcessor* share)
+	: egl(share != nullptr ? &share->egl : nullptr),
+			shared(share != nullptr), shared_luts(0),
+			width(width), height(height), tile_height(tile_height),
+			input_stride(width), samples(0),
+			gain(gain), use_ref(false), ref_after_lut(false),
+			robust_window(0), robust_median(false),
+			robust_kappa(3.0f), ring_index(0), ring_count(0),
+			resolved(false), accumulator_format(GL_RGB32UI),
+			deep_output(false), half_output(false),
+			lut(nullptr), accumulate_shader(nullptr),
+			output_shader(nullptr), output_raw_shader(nullptr),
+			robust_shader(nullptr), histogram_shader(nullptr)
+{
+	memset(ref_mean, 0, sizeof(ref_mean));
 
-	// create output framebuffer
-	glGenFramebuffers(1, &output_fb);
-	glBindFramebuffer(GL_FRAMEBUFFER, output_fb);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, output_tex, 0);
-	GL_ERROR();
-	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		printf("Error configuring framebuffer\n");
-		exit(1);
-	}
+	egl.make_current();
+
+	glGenTextures(1, &input_tex);
+	glGenTextures(1, &accumulation_tex);
+	glGenTextures(1, &output_tex);
+	glGenTextures(1, &output_raw_tex);
+	glGenTextures(1, &output_deep_tex);
+	glGenTextures(1, &output_half_tex);
 
-	// create RAW output framebuffer
+	glGenFramebuffers(1, &accumulation_fb);
+	glGenFramebuffers(1, &output_fb);
 	glGenFramebuffers(1, &output_raw_fb);
-	glBindFramebuffer(GL_FRAMEBUFFER, output_raw_fb);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, output_raw_tex, 0);
-	GL_ERROR();
-	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-		printf("Error configuring framebuffer\n");
-		exit(1);
+	glGenFramebuffers(1, &output_deep_fb);
+	glGenFramebuffers(1, &output_half_fb);
+
+	allocate();
+
+	// histogram bins, one row per channel
+	glGenTextures(1, &histogram_tex);
+	glGenFramebuffers(1, &histogram_fb);
+	setup_texture(histogram_tex, GL_R32F, HISTOGRAM_BINS, 3, GL_RED,
+			GL_FLOAT);
+	setup_framebuffer(histogram_fb, histogram_tex);
+
+	// load LUT
+	if(shared) {
+		luts = share->luts;
+		lut_textures = share->lut_textures;
+		shared_luts = luts.size();
+		if(lut_filename != nullptr) {
+			lut = luts[0];
+			lut_tex = lut_textures[0];
+		}
+	} else if(lut_filename != nullptr) {
+		lut = new LUT(lut_filename);
+		lut_tex = lut->create_texture();
+		luts.push_back(lut);
+		lut_textures.push_back(lut_tex);
 	}
+	GL_ERROR();
 
 	// create VBO/VAO
 	glGenVertexArrays(1, &quad_vao);
@@ -198,9 +188,35 @@ VideoProcessor::VideoProcessor(unsigned int width, unsigned int height,
 	glEnableVertexAttribArray(loc);
 	glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
 
-	accumulate_shader = new Shader(accumulate_vert, accumulate_frag);
-	output_shader = new Shader(output_vert, output_frag);
-	output_raw_shader = new Shader(output_raw_vert, output_raw_frag);
+	// defective pixels are drawn as points with the output shaders
+	glGenVertexArrays(1, &defect_vao);
+	glBindVertexArray(defect_vao);
+
+	glGenBuffers(1, &defect_vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, defect_vbo);
+
+	glEnableVertexAttribArray(loc);
+	glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	// the histogram points have no vertex attributes, so that no vertex
+	// is fetched beyond the end of a buffer
+	glGenVertexArrays(1, &histogram_vao);
+
+	if(shared) {
+		accumulate_shader = share->accumulate_shader;
+		output_shader = share->output_shader;
+		output_raw_shader = share->output_raw_shader;
+		robust_shader = share->robust_shader;
+		histogram_shader = share->histogram_shader;
+	} else {
+		accumulate_shader = new Shader(accumulate_vert,
+				accumulate_frag);
+		output_shader = new Shader(output_vert, output_frag);
+		output_raw_shader = new Shader(output_raw_vert,
+				output_raw_frag);
+		robust_shader = new Shader(robust_vert, robust_frag);
+		histogram_shader = new Shader(histogram_vert, histogram_frag);
+	}
 
 	accumulate_shader_frame = accumulate_shader->get_uniform("frame");
 	accumulate_shader_tex = accumulate_shader->get_uniform("accumulator");
@@ -215,9 +231,23 @@ VideoProcessor::VideoProcessor(unsigned int width, unsigned int height,
 	output_shader_use_lut = output_shader->get_uniform("use_lut");
 	output_shader_use_ref = output_shader->get_uniform("use_ref");
 	output_shader_ref_after_lut = output_shader->get_uniform("ref_after_lut");
+	output_shader_defect = output_shader->get_uniform("defect");
+	output_shader_bounds = output_shader->get_uniform("bounds");
 
 	output_raw_shader_frame = output_raw_shader->get_uniform("frame");
 	output_raw_shader_samples = output_raw_shader->get_uniform("samples");
+	output_raw_shader_defect = output_raw_shader->get_uniform("defect");
+	output_raw_shader_bounds = output_raw_shader->get_uniform("bounds");
+
+	robust_shader_frames = robust_shader->get_uniform("frames");
+	robust_shader_count = robust_shader->get_uniform("count");
+	robust_shader_median = robust_shader->get_uniform("median");
+	robust_shader_kappa = robust_shader->get_uniform("kappa");
+
+	histogram_shader_frame = histogram_shader->get_uniform("frame");
+	histogram_shader_samples = histogram_shader->get_uniform("samples");
+	histogram_shader_size = histogram_shader->get_uniform("size");
+	histogram_shader_step = histogram_shader->get_uniform("step");
 
 	egl.unbind();
 }
@@ -226,206 +256,860 @@ VideoProcessor::~VideoProcessor()
 {
 	egl.make_current();
 
-	if(accumulate_shader != nullptr) {
+	// the shaders and LUTs of a shared processor stay with their owner
+	if(!shared) {
 		delete accumulate_shader;
+		delete output_shader;
+		delete output_raw_shader;
+		delete robust_shader;
+		delete histogram_shader;
 	}
 
-	if(output_shader != nullptr) {
-		delete output_shader;
+	for(unsigned int i = shared_luts; i < luts.size(); i++) {
+		glDeleteTextures(1, &lut_textures[i]);
+		delete luts[i];
 	}
 
+	release();
+
+	glDeleteBuffers(1, &defect_vbo);
+	glDeleteVertexArrays(1, &defect_vao);
+	glDeleteVertexArrays(1, &histogram_vao);
+
+	glDeleteFramebuffers(1, &accumulation_fb);
+	glDeleteFramebuffers(1, &output_fb);
+	glDeleteFramebuffers(1, &output_raw_fb);
+	glDeleteFramebuffers(1, &output_deep_fb);
+	glDeleteFramebuffers(1, &output_half_fb);
+	glDeleteFramebuffers(1, &histogram_fb);
+
 	glDeleteTextures(1, &input_tex);
-	glDeleteTextures(1, &accumulation_1_tex);
-	glDeleteTextures(1, &accumulation_2_tex);
+	glDeleteTextures(1, &accumulation_tex);
 	glDeleteTextures(1, &output_tex);
+	glDeleteTextures(1, &output_raw_tex);
+	glDeleteTextures(1, &output_deep_tex);
+	glDeleteTextures(1, &output_half_tex);
+	glDeleteTextures(1, &histogram_tex);
 
-	if(lut != nullptr) {
-		glDeleteTextures(1, &lut_tex);
-		delete lut;
+	egl.unbind();
+}
+
+// Returns the size of the textures which cover the whole frame, and in
+// per_row the size of those which only cover one tile, per row.
+size_t VideoProcessor::texture_memory(unsigned int width, unsigned int height,
+		bool use_ref, unsigned int ring, unsigned int deep, bool narrow,
+		size_t* per_row)
+{
+	size_t accumulator = narrow ? 4 * sizeof(uint16_t) :
+		3 * sizeof(uint32_t);
+
+	size_t pixels = (size_t) width * height;
+	size_t persistent = pixels * (accumulator +
+			(use_ref ? 4 * sizeof(uint16_t) : 0) +
+			(size_t) ring * 3 * sizeof(uint16_t));
+
+	// input + spare accumulator + output + RAW output
+	*per_row = width * (4 * sizeof(uint16_t) + accumulator +
+			4 * sizeof(uint8_t) + 4 * sizeof(uint16_t));
+
+	// 16bit graded outputs
+	*per_row += (size_t) deep * width * 4 * sizeof(uint16_t);
+
+	return persistent;
+}
+
+// Returns the largest band height for which all textures fit into budget
+// bytes, or 0 if not even a single row fits. The accumulators of all bands
+// (and the reference frame and ring of ring frames for robust stacking) cover
+// the whole frame, everything else is only allocated once with the size of a
+// band.
+unsigned int VideoProcessor::tile_height_for_budget(unsigned int width,
+		unsigned int height, size_t budget, bool use_ref,
+		unsigned int ring, unsigned int deep, bool narrow)
+{
+	size_t per_row;
+	size_t persistent = texture_memory(width, height, use_ref, ring, deep,
+			narrow, &per_row);
+
+	if(budget < persistent + per_row) {
+		return 0;
 	}
 
-	egl.unbind();
+	size_t rows = (budget - persistent) / per_row;
+	if(rows > height) {
+		rows = height;
+	}
+
+	return (unsigned int) rows;
+}
+
+// (Re)allocates all frame sized textures; the context must be current.
+void VideoProcessor::allocate()
+{
+	unsigned int rows = tile_height;
+	if(rows == 0 || rows > height) {
+		rows = height;
+	}
+
+	// input (video frame) texture
+	setup_texture(input_tex, GL_RGBA16UI, width, rows, GL_RGBA_INTEGER,
+			GL_UNSIGNED_SHORT);
+
+	// spare accumulation texture, swapped with the one of a band after
+	// every pass
+	setup_accumulator(accumulation_tex, rows);
+
+	// output texture
+	setup_texture(output_tex, GL_RGBA8, width, rows, GL_BGRA,
+			GL_UNSIGNED_BYTE);
+
+	// RAW output texture
+	setup_texture(output_raw_tex, GL_RGBA16UI, width, rows,
+			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT);
+
+	setup_framebuffer(accumulation_fb, accumulation_tex);
+	setup_framebuffer(output_fb, output_tex);
+	setup_framebuffer(output_raw_fb, output_raw_tex);
+
+	// 16bit graded output textures, only when requested
+	if(deep_output) {
+		setup_texture(output_deep_tex, GL_RGBA16, width, rows,
+				GL_RGBA, GL_UNSIGNED_SHORT);
+		setup_framebuffer(output_deep_fb, output_deep_tex);
+	}
+	if(half_output) {
+		setup_texture(output_half_tex, GL_RGBA16F, width, rows,
+				GL_RGBA, GL_HALF_FLOAT);
+		setup_framebuffer(output_half_fb, output_half_tex);
+	}
+
+	// accumulation textures of the bands
+	for(unsigned int y = 0; y < height; y += rows) {
+		Band band;
+		band.y = y;
+		band.height = height - y < rows ? height - y : rows;
+		band.ref_tex = 0;
+		band.ring_tex = 0;
+		band.defect_first = 0;
+		band.defect_count = 0;
+
+		glGenTextures(1, &band.accumulation_tex);
+		glGenFramebuffers(1, &band.accumulation_fb);
+		setup_accumulator(band.accumulation_tex, rows);
+		setup_framebuffer(band.accumulation_fb, band.accumulation_tex);
+
+		if(robust_window) {
+			allocate_ring(band);
+		}
+
+		bands.push_back(band);
+	}
+
+	clear();
+}
+
+// Allocates an accumulation texture in the current accumulator format; the
+// context must be current.
+void VideoProcessor::setup_accumulator(GLuint tex, unsigned int rows)
+{
+	if(accumulator_format == GL_RGBA16UI) {
+		setup_texture(tex, GL_RGBA16UI, width, rows, GL_RGBA_INTEGER,
+				GL_UNSIGNED_SHORT);
+
+		// the shaders read the alpha of an RGB texture, which is 1
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ONE);
+	} else {
+		setup_texture(tex, GL_RGB32UI, width, rows, GL_RGB_INTEGER,
+				GL_UNSIGNED_INT);
+	}
+}
+
+// Returns whether the sum of window frames with input_bits per channel fits
+// into a 16bit accumulator. The robust mean is resolved into the accumulator
+// as a single sample, so it always fits.
+bool VideoProcessor::narrow_accumulator(unsigned int window,
+		unsigned int input_bits, unsigned int ring)
+{
+	if(ring) {
+		return true;
+	}
+
+	return (uint64_t) window * ((1u << input_bits) - 1) <= 65535;
 }
 
-void VideoProcessor::load_reference(uint16_t* image, bool after_lut)
+// Chooses the accumulator for windows of up to window frames: RGBA16UI
+// (8 instead of 12 bytes per pixel) if the sums cannot overflow it, RGB32UI
+// otherwise. Has to be called after set_robust and before the first frame,
+// as the accumulator is cleared when the format changes.
+void VideoProcessor::set_window(unsigned int window, unsigned int input_bits)
 {
+	GLenum format = narrow_accumulator(window, input_bits,
+			robust_window) ? GL_RGBA16UI : GL_RGB32UI;
+	if(format == accumulator_format) {
+		return;
+	}
+
 	egl.make_current();
-	GL_ERROR();
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, input_ref_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, image);
+	accumulator_format = format;
+
+	unsigned int rows = bands[0].height;
+	setup_accumulator(accumulation_tex, rows);
+	setup_framebuffer(accumulation_fb, accumulation_tex);
+	for(Band& band : bands) {
+		setup_accumulator(band.accumulation_tex, rows);
+		setup_framebuffer(band.accumulation_fb, band.accumulation_tex);
+	}
+
+	clear();
+
+	egl.unbind();
+}
+
+// Deletes the per band textures; the context must be current.
+void VideoProcessor::release()
+{
+	for(Band& band : bands) {
+		glDeleteFramebuffers(1, &band.accumulation_fb);
+		glDeleteTextures(1, &band.accumulation_tex);
+		if(band.ref_tex != 0) {
+			glDeleteTextures(1, &band.ref_tex);
+		}
+		if(band.ring_tex != 0) {
+			glDeleteTextures(1, &band.ring_tex);
+		}
+	}
+
+	bands.clear();
+}
+
+// Creates the frame ring of a band, packed to 16bit RGB; the context must be
+// current.
+void VideoProcessor::allocate_ring(Band& band)
+{
+	if(band.ring_tex != 0) {
+		glDeleteTextures(1, &band.ring_tex);
+	}
 
+	glGenTextures(1, &band.ring_tex);
+	setup_texture_array(band.ring_tex, GL_RGB16UI, width, band.height,
+			robust_window, GL_RGB_INTEGER, GL_UNSIGNED_SHORT);
+}
+
+// Empties the accumulator; the context must be current.
+void VideoProcessor::clear()
+{
+	static const GLuint zero[4] = { 0, 0, 0, 0 };
+
+	for(Band& band : bands) {
+		glBindFramebuffer(GL_FRAMEBUFFER, band.accumulation_fb);
+		glClearBufferuiv(GL_COLOR, 0, zero);
+	}
 	GL_ERROR();
 
-	uint16_t* pixels = image;
-	uint64_t sum[4] = { 0 };
-	size_t count = width * height;
-	for(size_t i = 0; i < count; i++) {
-		sum[0] += pixels[0];
-		sum[1] += pixels[1];
-		sum[2] += pixels[2];
-		sum[3] += pixels[3];
-		pixels += 4;
+	samples = 0;
+	ring_index = 0;
+	ring_count = 0;
+	resolved = false;
+}
+
+bool VideoProcessor::resize(unsigned int width, unsigned int height,
+		unsigned int tile_height)
+{
+	bool resized = width != this->width || height != this->height ||
+		tile_height != this->tile_height;
+
+	egl.make_current();
+
+	if(resized) {
+		this->width = width;
+		this->height = height;
+		this->tile_height = tile_height;
+		input_stride = width;
+
+		// a reference frame of the old size is useless now
+		use_ref = false;
+		memset(ref_mean, 0, sizeof(ref_mean));
+
+		release();
+		allocate();
+	} else {
+		clear();
 	}
 
-	use_ref = true;
-	ref_after_lut = after_lut;
+	egl.unbind();
+
+	return resized;
+}
+
+unsigned int VideoProcessor::get_bands()
+{
+	return bands.size();
+}
+
+// Estimates the GPU memory used by the frame sized textures.
+size_t VideoProcessor::get_gpu_memory()
+{
+	unsigned int rows = tile_height;
+	if(rows == 0 || rows > height) {
+		rows = height;
+	}
+
+	size_t per_row;
+	size_t persistent = texture_memory(width, height, use_ref,
+			robust_window, deep_output + half_output,
+			accumulator_format == GL_RGBA16UI, &per_row);
+
+	return persistent + rows * per_row;
+}
+
+// Sets the row length (in pixels) of the frames passed to add/subtract. This
+// allows to process a crop of a larger frame without copying it first.
+void VideoProcessor::set_input_stride(unsigned int stride)
+{
+	input_stride = stride;
+}
+
+// Switches to robust stacking over the last window frames: per pixel median
+// or mean of the samples within kappa standard deviations. A window of 0
+// switches back to the running sum.
+bool VideoProcessor::set_robust(unsigned int window, bool median, float kappa)
+{
+	robust_median = median;
+	robust_kappa = kappa;
+
+	if(window == robust_window) {
+		return true;
+	}
+
+	egl.make_current();
+
+	GLint max_layers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	if(window > (unsigned int) max_layers) {
+		printf("Robust stacking supports at most %d frames\n",
+				max_layers);
+		egl.unbind();
+		return false;
+	}
 
-	for(unsigned int i = 0; i < 4; i++) {
-		ref_mean[i] = sum[i] / count;
+	robust_window = window;
+	for(Band& band : bands) {
+		if(window) {
+			allocate_ring(band);
+		} else if(band.ring_tex != 0) {
+			glDeleteTextures(1, &band.ring_tex);
+			band.ring_tex = 0;
+		}
 	}
 
+	clear();
+
 	egl.unbind();
+
+	return true;
 }
 
-void VideoProcessor::add(uint16_t* image)
+// Sets the defective pixels (x/y pairs), which are replaced by the median of
+// their neighbours in every output pass. Must be called again after resize.
+void VideoProcessor::set_defects(const unsigned int* points,
+		unsigned int count)
 {
-	samples++;
+	// one point per defect in the coordinates of the viewport of its band
+	std::vector<float> vertices;
+	for(Band& band : bands) {
+		band.defect_first = vertices.size() / 3;
+		for(unsigned int i = 0; i < count; i++) {
+			unsigned int x = points[i * 2];
+			unsigned int y = points[i * 2 + 1];
+			if(x >= width || y < band.y || y >= band.y + band.height) {
+				continue;
+			}
+			vertices.push_back((x + 0.5f) / width * 2.0f - 1.0f);
+			vertices.push_back((y - band.y + 0.5f) / band.height *
+					2.0f - 1.0f);
+			vertices.push_back(0.0f);
+		}
+		band.defect_count = vertices.size() / 3 - band.defect_first;
+	}
 
 	egl.make_current();
+
+	glBindBuffer(GL_ARRAY_BUFFER, defect_vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float),
+			vertices.data(), GL_STATIC_DRAW);
 	GL_ERROR();
 
-	glViewport(0, 0, width, height);
-	accumulate_shader->use();
+	egl.unbind();
+}
+
+// The image has the row length of the input frames (see set_input_stride).
+// The mean is computed from the image unless it is given (e.g. from the
+// header of a master dark).
+void VideoProcessor::load_reference(uint16_t* image, bool after_lut,
+		const unsigned int* mean)
+{
+	egl.make_current();
+	GL_ERROR();
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, input_stride);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, input_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, image);
+	for(Band& band : bands) {
+		if(band.ref_tex == 0) {
+			glGenTextures(1, &band.ref_tex);
+			setup_texture(band.ref_tex, GL_RGBA16UI, width,
+					bands[0].height, GL_RGBA_INTEGER,
+					GL_UNSIGNED_SHORT);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, band.ref_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, band.height,
+				GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
+				image + (size_t) band.y * input_stride * 4);
+	}
 
-	if(current_accumulator) {
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, accumulation_1_tex);
-		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_2_fb);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+	GL_ERROR();
+
+	use_ref = true;
+	ref_after_lut = after_lut;
+
+	if(mean != nullptr) {
+		memcpy(ref_mean, mean, sizeof(ref_mean));
 	} else {
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, accumulation_2_tex);
-		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_1_fb);
+		reference_mean(image, width, height, input_stride, ref_mean);
 	}
 
-	current_accumulator = !current_accumulator;
+	egl.unbind();
+}
+
+void VideoProcessor::accumulate(uint16_t* image, bool add)
+{
+	egl.make_current();
+	GL_ERROR();
+
+	accumulate_shader->use();
 
 	glUniform1i(accumulate_shader_frame, 0);
 	glUniform1i(accumulate_shader_tex, 1);
-	glUniform1i(accumulate_shader_add, 1);
+	glUniform1i(accumulate_shader_add, add ? 1 : 0);
 
 	glBindVertexArray(quad_vao);
-	glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, input_stride);
+
+	for(Band& band : bands) {
+		glViewport(0, 0, width, band.height);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, input_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, band.height,
+				GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
+				image + (size_t) band.y * input_stride * 4);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, band.accumulation_tex);
+		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_fb);
+
+		glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+
+		// the result is the new accumulator of this band, the old one
+		// becomes the spare texture
+		GLuint tex = band.accumulation_tex;
+		GLuint fb = band.accumulation_fb;
+		band.accumulation_tex = accumulation_tex;
+		band.accumulation_fb = accumulation_fb;
+		accumulation_tex = tex;
+		accumulation_fb = fb;
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
 	GL_ERROR();
 
 	egl.unbind();
 }
 
-void VideoProcessor::subtract(uint16_t* image)
+// Stores a frame in the ring, replacing the oldest one once it is full.
+void VideoProcessor::push(uint16_t* image)
 {
-	samples--;
-
 	egl.make_current();
 	GL_ERROR();
 
-	glViewport(0, 0, width, height);
-	accumulate_shader->use();
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, input_stride);
 
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, input_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, width, height, 0,
-			GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, image);
+	for(Band& band : bands) {
+		glBindTexture(GL_TEXTURE_2D_ARRAY, band.ring_tex);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, ring_index,
+				width, band.height, 1, GL_RGBA_INTEGER,
+				GL_UNSIGNED_SHORT,
+				image + (size_t) band.y * input_stride * 4);
+	}
 
-	if(current_accumulator) {
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, accumulation_1_tex);
-		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_2_fb);
-	} else {
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, accumulation_2_tex);
-		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_1_fb);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+	GL_ERROR();
+
+	resolved = false;
+	ring_index = (ring_index + 1) % robust_window;
+	if(ring_count < robust_window) {
+		ring_count++;
 	}
+	samples = ring_count;
+
+	egl.unbind();
+}
 
-	current_accumulator = !current_accumulator;
+// Computes the robust mean of the ring into the accumulators as a single
+// sample; the context must be current.
+void VideoProcessor::resolve()
+{
+	robust_shader->use();
 
-	glUniform1i(accumulate_shader_frame, 0);
-	glUniform1i(accumulate_shader_tex, 1);
-	glUniform1i(accumulate_shader_add, 0);
+	glUniform1i(robust_shader_frames, 0);
+	glUniform1ui(robust_shader_count, ring_count);
+	glUniform1i(robust_shader_median, robust_median ? 1 : 0);
+	glUniform1f(robust_shader_kappa, robust_kappa);
 
 	glBindVertexArray(quad_vao);
-	glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+
+	for(Band& band : bands) {
+		glViewport(0, 0, width, band.height);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, band.ring_tex);
+		glBindFramebuffer(GL_FRAMEBUFFER, accumulation_fb);
+
+		glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+
+		GLuint tex = band.accumulation_tex;
+		GLuint fb = band.accumulation_fb;
+		band.accumulation_tex = accumulation_tex;
+		band.accumulation_fb = accumulation_fb;
+		accumulation_tex = tex;
+		accumulation_fb = fb;
+	}
 
 	GL_ERROR();
 
-	egl.unbind();
+	resolved = true;
 }
 
-void VideoProcessor::output(uint8_t* image)
+// Redraws the defective pixels of a band with the current output shader;
+// the context must be current.
+void VideoProcessor::draw_defects(Band& band, GLuint defect, GLuint bounds)
 {
-	egl.make_current();
+	if(band.defect_count == 0) {
+		return;
+	}
 
-	glViewport(0, 0, width, height);
-	output_shader->use();
+	glUniform1i(defect, 1);
+	glUniform2i(bounds, width, band.height);
 
-	glActiveTexture(GL_TEXTURE0);
-	if(current_accumulator) {
-		glBindTexture(GL_TEXTURE_2D, accumulation_1_tex);
-	} else {
-		glBindTexture(GL_TEXTURE_2D, accumulation_2_tex);
+	glBindVertexArray(defect_vao);
+	glDrawArrays(GL_POINTS, band.defect_first, band.defect_count);
+
+	glUniform1i(defect, 0);
+	glBindVertexArray(quad_vao);
+}
+
+void VideoProcessor::add(uint16_t* image)
+{
+	if(robust_window) {
+		push(image);
+		return;
+	}
+
+	samples++;
+	accumulate(image, true);
+}
+
+void VideoProcessor::subtract(uint16_t* image)
+{
+	if(robust_window) {
+		// the ring drops the oldest frame by itself
+		return;
 	}
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, input_ref_tex);
+	samples--;
+	accumulate(image, false);
+}
 
-	if(lut != nullptr) {
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_3D, lut_tex);
+// Renders the graded frame into fb and reads it back with the given pixel
+// format; pixel_size is the size of a pixel in image.
+void VideoProcessor::render(GLuint fb, GLenum format, GLenum type, void* image,
+		size_t pixel_size)
+{
+	egl.make_current();
+
+	// the robust mean is resolved into the accumulator as one sample
+	unsigned int divisor = samples;
+	if(robust_window) {
+		if(!resolved) {
+			resolve();
+		}
+		divisor = 1;
 	}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, output_fb);
+	output_shader->use();
 
 	glUniform1i(output_shader_frame, 0);
 	glUniform1i(output_shader_ref, 1);
 	glUniform1i(output_shader_lut, 2);
-	glUniform1ui(output_shader_samples, samples);
+	glUniform1ui(output_shader_samples, divisor);
 	glUniform1f(output_shader_gain, gain);
 	glUniform4uiv(output_shader_ref_mean, 1, ref_mean);
 	glUniform1i(output_shader_use_lut, lut != nullptr);
 	glUniform1i(output_shader_use_ref, use_ref ? 1 : 0);
 	glUniform1i(output_shader_ref_after_lut, ref_after_lut ? 1 : 0);
 
+	if(lut != nullptr) {
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_3D, lut_tex);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
 	glBindVertexArray(quad_vao);
-	glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
 
-	GL_ERROR();
-	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, image);
-	GL_ERROR();
+	for(Band& band : bands) {
+		glViewport(0, 0, width, band.height);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, band.accumulation_tex);
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, band.ref_tex);
+
+		glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+		draw_defects(band, output_shader_defect, output_shader_bounds);
+
+		GL_ERROR();
+		glReadPixels(0, 0, width, band.height, format, type,
+				(uint8_t*) image +
+				(size_t) band.y * width * pixel_size);
+		GL_ERROR();
+	}
+
+	egl.unbind();
+}
+
+void VideoProcessor::output(uint8_t* image)
+{
+	render(output_fb, GL_BGRA, GL_UNSIGNED_BYTE, image, 4);
+}
+
+// Enables a 16bit graded output, either as normalized 16bit integers or as
+// half floats (both RGBA). Both may be enabled at the same time.
+void VideoProcessor::set_deep_output(bool half)
+{
+	egl.make_current();
+
+	unsigned int rows = bands.empty() ? height : bands[0].height;
+	if(half) {
+		half_output = true;
+		setup_texture(output_half_tex, GL_RGBA16F, width, rows,
+				GL_RGBA, GL_HALF_FLOAT);
+		setup_framebuffer(output_half_fb, output_half_tex);
+	} else {
+		deep_output = true;
+		setup_texture(output_deep_tex, GL_RGBA16, width, rows,
+				GL_RGBA, GL_UNSIGNED_SHORT);
+		setup_framebuffer(output_deep_fb, output_deep_tex);
+	}
+
 	egl.unbind();
 }
 
+// Like output, but with 16bit per channel (see set_deep_output): as half
+// floats if half is set, otherwise as normalized 16bit integers. The
+// corresponding output must have been enabled.
+void VideoProcessor::output_deep(uint16_t* image, bool half)
+{
+	if(half) {
+		render(output_half_fb, GL_RGBA, GL_HALF_FLOAT, image,
+				4 * sizeof(uint16_t));
+	} else {
+		render(output_deep_fb, GL_RGBA, GL_UNSIGNED_SHORT, image,
+				4 * sizeof(uint16_t));
+	}
+}
+
 void VideoProcessor::output_raw(uint16_t* image)
 {
 	egl.make_current();
 
-	glViewport(0, 0, width, height);
+	// the robust mean is resolved into the accumulator as one sample
+	unsigned int divisor = samples;
+	if(robust_window) {
+		if(!resolved) {
+			resolve();
+		}
+		divisor = 1;
+	}
+
 	output_raw_shader->use();
 
+	glUniform1i(output_raw_shader_frame, 0);
+	glUniform1ui(output_raw_shader_samples, divisor);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, output_raw_fb);
+	glBindVertexArray(quad_vao);
+
+	for(Band& band : bands) {
+		glViewport(0, 0, width, band.height);
+
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, band.accumulation_tex);
+
+		glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+		draw_defects(band, output_raw_shader_defect,
+				output_raw_shader_bounds);
+
+		GL_ERROR();
+		glReadPixels(0, 0, width, band.height, GL_RGBA_INTEGER,
+				GL_UNSIGNED_SHORT,
+				image + (size_t) band.y * width * 4);
+		GL_ERROR();
+	}
+
+	egl.unbind();
+}
+
+// Computes the per channel histograms of the averaged frame (HISTOGRAM_BINS
+// bins per channel) on the GPU; only the bins are read back. Every pixel is
+// added to its bin by blending a point into the bin texture.
+void VideoProcessor::histogram(float* bins)
+{
+	static const GLfloat zero[4] = { 0, 0, 0, 0 };
+
+	egl.make_current();
+
+	unsigned int divisor = samples;
+	if(robust_window) {
+		if(!resolved) {
+			resolve();
+		}
+		divisor = 1;
+	}
+
+	unsigned int step = 1;
+	while((size_t) width * height / ((size_t) step * step) >
+			HISTOGRAM_SAMPLES) {
+		step++;
+	}
+
+	histogram_shader->use();
+
+	glUniform1i(histogram_shader_frame, 0);
+	glUniform1ui(histogram_shader_samples, divisor ? divisor : 1);
+	glUniform1i(histogram_shader_step, step);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, histogram_fb);
+	glClearBufferfv(GL_COLOR, 0, zero);
+	glViewport(0, 0, HISTOGRAM_BINS, 3);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	// no vertex attributes, the pixel is derived from the vertex ID
+	glBindVertexArray(histogram_vao);
+
 	glActiveTexture(GL_TEXTURE0);
-	if(current_accumulator) {
-		glBindTexture(GL_TEXTURE_2D, accumulation_1_tex);
+	for(Band& band : bands) {
+		glBindTexture(GL_TEXTURE_2D, band.accumulation_tex);
+		glUniform2i(histogram_shader_size, width, band.height);
+
+		unsigned int columns = (width + step - 1) / step;
+		unsigned int rows = (band.height + step - 1) / step;
+		glDrawArraysInstanced(GL_POINTS, 0, columns * rows, 3);
+	}
+
+	glDisable(GL_BLEND);
+
+	GL_ERROR();
+	glReadPixels(0, 0, HISTOGRAM_BINS, 3, GL_RED, GL_FLOAT, bins);
+	GL_ERROR();
+
+	egl.unbind();
+}
+
+float VideoProcessor::get_gain()
+{
+	return gain;
+}
+
+void VideoProcessor::set_gain(float gain)
+{
+	this->gain = gain;
+}
+
+// Loads another LUT and returns its index for select_lut. The LUT of the
+// constructor has index 0; a shared processor starts with the LUTs its owner
+// had loaded when it was created.
+int VideoProcessor::add_lut(const char* filename)
+{
+	egl.make_current();
+
+	LUT* extra = new LUT(filename);
+	luts.push_back(extra);
+	lut_textures.push_back(extra->create_texture());
+
+	egl.unbind();
+
+	return luts.size() - 1;
+}
+
+// Selects the LUT of the graded outputs, -1 for none.
+void VideoProcessor::select_lut(int index)
+{
+	if(index < 0) {
+		lut = nullptr;
 	} else {
-		glBindTexture(GL_TEXTURE_2D, accumulation_2_tex);
+		lut = luts[index];
+		lut_tex = lut_textures[index];
 	}
+}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, output_raw_fb);
+unsigned int VideoProcessor::get_samples()
+{
+	return samples;
+}
 
-	glUniform1i(output_raw_shader_frame, 0);
-	glUniform1ui(output_raw_shader_samples, samples);
+void VideoProcessor::save_state(uint32_t* accumulator)
+{
+	egl.make_current();
 
-	glBindVertexArray(quad_vao);
-	glDrawArrays(GL_TRIANGLES, 0, QUAD_VTX_CNT);
+	for(Band& band : bands) {
+		glBindFramebuffer(GL_FRAMEBUFFER, band.accumulation_fb);
 
+		GL_ERROR();
+		glReadPixels(0, 0, width, band.height, GL_RGB_INTEGER,
+				GL_UNSIGNED_INT,
+				accumulator + (size_t) band.y * width * 3);
+		GL_ERROR();
+	}
+
+	egl.unbind();
+}
+
+void VideoProcessor::load_state(uint32_t* accumulator, unsigned int samples)
+{
+	this->samples = samples;
+
+	egl.make_current();
 	GL_ERROR();
-	glReadPixels(0, 0, width, height, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT,
-			image);
+
+	glActiveTexture(GL_TEXTURE0);
+	for(Band& band : bands) {
+		glBindTexture(GL_TEXTURE_2D, band.accumulation_tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, band.height,
+				GL_RGB_INTEGER, GL_UNSIGNED_INT,
+				accumulator + (size_t) band.y * width * 3);
+	}
+
 	GL_ERROR();
 	egl.unbind();
 }
@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <vector>
+
+#include "reference.h"
+
+// pixels per thread below which more threads do not pay off
+#define	MEAN_MIN_PIXELS	(1 << 18)
+
+// Per channel mean of an RGBA image with stride pixels per row, summed on
+// all cores.
+void reference_mean(const uint16_t* image, unsigned int width,
+		unsigned int height, unsigned int stride, unsigned int* mean)
+{
+	size_t pixels = (size_t) width * height;
+	unsigned int threads = std::thread::hardware_concurrency();
+	if(threads == 0) {
+		threads = 1;
+	}
+	if(threads > pixels / MEAN_MIN_PIXELS) {
+		threads = pixels / MEAN_MIN_PIXELS;
+	}
+	if(threads == 0) {
+		threads = 1;
+	}
+
+	std::vector<uint64_t> sums(threads * 4, 0);
+	std::vector<std::thread> workers;
+	unsigned int slice = (height + threads - 1) / threads;
+
+	for(unsigned int t = 0; t < threads; t++) {
+		unsigned int start = t * slice;
+		unsigned int end = start + slice < height ? start + slice :
+			height;
+		uint64_t* sum = &sums[t * 4];
+		workers.push_back(std::thread([=] {
+			uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+			for(unsigned int y = start; y < end; y++) {
+				const uint16_t* p = image +
+					(size_t) y * stride * 4;
+				for(unsigned int x = 0; x < width; x++) {
+					s0 += p[0];
+					s1 += p[1];
+					s2 += p[2];
+					s3 += p[3];
+					p += 4;
+				}
+			}
+			sum[0] = s0;
+			sum[1] = s1;
+			sum[2] = s2;
+			sum[3] = s3;
+		}));
+	}
+
+	for(std::thread& worker : workers) {
+		worker.join();
+	}
+
+	for(unsigned int i = 0; i < 4; i++) {
+		uint64_t sum = 0;
+		for(unsigned int t = 0; t < threads; t++) {
+			sum += sums[t * 4 + i];
+		}
+		mean[i] = pixels ? sum / pixels : 0;
+	}
+}
+
+void reference_header(ReferenceHeader* header, const uint16_t* image,
+		unsigned int width, unsigned int height, unsigned long frames)
+{
+	memset(header, 0, sizeof(ReferenceHeader));
+	memcpy(header->magic, REFERENCE_MAGIC, sizeof(header->magic));
+	header->version = REFERENCE_VERSION;
+	header->width = width;
+	header->height = height;
+	header->frames = frames;
+
+	unsigned int mean[4];
+	reference_mean(image, width, height, width, mean);
+	for(unsigned int i = 0; i < 4; i++) {
+		header->mean[i] = mean[i];
+	}
+}
+
+// Reads a reference frame with or without header. Returns nullptr on error.
+uint16_t* read_reference(const char* filename, size_t* pixels,
+		ReferenceHeader* header, bool* has_header)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		printf("Error opening %s: %s\n", filename, strerror(errno));
+		return nullptr;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size_t size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	*has_header = false;
+	if(size >= sizeof(ReferenceHeader)) {
+		if(fread(header, sizeof(ReferenceHeader), 1, f) == 1 &&
+				!memcmp(header->magic, REFERENCE_MAGIC,
+					sizeof(header->magic))) {
+			if(header->version != REFERENCE_VERSION) {
+				printf("Unsupported reference frame version %u\n",
+						header->version);
+				fclose(f);
+				return nullptr;
+			}
+			*has_header = true;
+			size -= sizeof(ReferenceHeader);
+		} else {
+			fseek(f, 0, SEEK_SET);
+		}
+	}
+
+	*pixels = size / (4 * sizeof(uint16_t));
+	if(*has_header && *pixels != (size_t) header->width * header->height) {
+		printf("Reference frame %s is truncated\n", filename);
+		fclose(f);
+		return nullptr;
+	}
+
+	uint16_t* image = new uint16_t[*pixels * 4];
+	if(fread(image, sizeof(uint16_t) * 4, *pixels, f) != *pixels) {
+		printf("Error reading %s\n", filename);
+		delete[] image;
+		fclose(f);
+		return nullptr;
+	}
+
+	fclose(f);
+
+	return image;
+}
@@ -0,0 +1,173 @@
+#include <cstdio>
+#include <cstring>
+
+#include "resources.h"
+
+// smaller buffers are not worth pooling (or a huge page)
+#define	POOL_MIN_SIZE		(1U << 20)
+
+// size classes per power of two, i.e. at most 25% is wasted
+#define	CLASSES_PER_OCTAVE	4
+
+// idle buffers kept per size class; the pipeline depth is covered by the
+// buffers in use
+#define	MAX_IDLE_BUFFERS	8
+
+PooledResourceManager::PooledResourceManager(HugePages huge_pages, bool lock)
+	: huge_pages(huge_pages), lock_pages(lock), fallback(nullptr)
+{
+}
+
+// The codec must have released all resources.
+PooledResourceManager::~PooledResourceManager()
+{
+	resources.clear();
+
+	for(auto& pool : pools) {
+		delete pool.second;
+	}
+
+	if(fallback != nullptr) {
+		fallback->Release();
+	}
+}
+
+// Replaces the resource manager of codec; its own manager still handles the
+// GPU resources.
+bool PooledResourceManager::install(IBlackmagicRaw* codec)
+{
+	IBlackmagicRawConfigurationEx* config = nullptr;
+	if(codec->QueryInterface(IID_IBlackmagicRawConfigurationEx,
+				(LPVOID*) &config) != S_OK) {
+		return false;
+	}
+
+	bool ok = config->GetResourceManager(&fallback) == S_OK &&
+		config->SetResourceManager(this) == S_OK;
+	config->Release();
+
+	return ok;
+}
+
+// Rounds size up to its size class, which is a multiple of the page size.
+size_t PooledResourceManager::size_class(uint32_t size)
+{
+	size_t octave = 1;
+	while(octave * 2 <= size) {
+		octave *= 2;
+	}
+
+	size_t step = octave / CLASSES_PER_OCTAVE;
+	size_t page = BufferPool::page_size(huge_pages);
+	if(step < page) {
+		step = page;
+	}
+
+	return (size + step - 1) / step * step;
+}
+
+bool PooledResourceManager::pooled(void* resource)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return resources.count(resource) != 0;
+}
+
+HRESULT PooledResourceManager::CreateResource(void* context,
+		void* commandQueue, uint32_t sizeBytes,
+		BlackmagicRawResourceType type,
+		BlackmagicRawResourceUsage usage, void** resource)
+{
+	if(type != blackmagicRawResourceTypeBufferCPU ||
+			sizeBytes < POOL_MIN_SIZE) {
+		return fallback->CreateResource(context, commandQueue,
+				sizeBytes, type, usage, resource);
+	}
+
+	size_t size = size_class(sizeBytes);
+
+	BufferPool* pool;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = pools.find(size);
+		if(it == pools.end()) {
+			pool = new BufferPool(size, huge_pages, lock_pages,
+					MAX_IDLE_BUFFERS);
+			pools[size] = pool;
+		} else {
+			pool = it->second;
+		}
+	}
+
+	FrameBuffer buffer = pool->acquire();
+	*resource = buffer.get<void>();
+
+	std::lock_guard<std::mutex> guard(lock);
+	resources[*resource] = std::move(buffer);
+
+	return S_OK;
+}
+
+HRESULT PooledResourceManager::ReleaseResource(void* context,
+		void* commandQueue, void* resource,
+		BlackmagicRawResourceType type)
+{
+	if(type != blackmagicRawResourceTypeBufferCPU) {
+		return fallback->ReleaseResource(context, commandQueue,
+				resource, type);
+	}
+
+	// the buffer returns to its pool with the handle
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if(resources.erase(resource) != 0) {
+			return S_OK;
+		}
+	}
+
+	return fallback->ReleaseResource(context, commandQueue, resource,
+			type);
+}
+
+HRESULT PooledResourceManager::CopyResource(void* context, void* commandQueue,
+		void* source, BlackmagicRawResourceType sourceType,
+		void* destination, BlackmagicRawResourceType destinationType,
+		uint32_t sizeBytes, bool copyAsync)
+{
+	if(sourceType != blackmagicRawResourceTypeBufferCPU ||
+			destinationType != blackmagicRawResourceTypeBufferCPU ||
+			(!pooled(source) && !pooled(destination))) {
+		return fallback->CopyResource(context, commandQueue, source,
+				sourceType, destination, destinationType,
+				sizeBytes, copyAsync);
+	}
+
+	// one of the buffers may still belong to the SDK's manager
+	void* from = nullptr;
+	void* to = nullptr;
+	HRESULT result = GetResourceHostPointer(context, commandQueue, source,
+			sourceType, &from);
+	if(result == S_OK) {
+		result = GetResourceHostPointer(context, commandQueue,
+				destination, destinationType, &to);
+	}
+	if(result != S_OK) {
+		return result;
+	}
+
+	memcpy(to, from, sizeBytes);
+	return S_OK;
+}
+
+HRESULT PooledResourceManager::GetResourceHostPointer(void* context,
+		void* commandQueue, void* resource,
+		BlackmagicRawResourceType resourceType, void** hostPointer)
+{
+	if(resourceType != blackmagicRawResourceTypeBufferCPU ||
+			!pooled(resource)) {
+		return fallback->GetResourceHostPointer(context, commandQueue,
+				resource, resourceType, hostPointer);
+	}
+
+	*hostPointer = resource;
+	return S_OK;
+}
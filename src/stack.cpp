@@ -0,0 +1,170 @@
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include "stack.h"
+
+// 65535 frames of 65535 still fit into 32bit
+#define	PARTIAL_LIMIT	65535
+
+Stack::Stack(unsigned int width, unsigned int height, unsigned int partials)
+	: width(width), height(height), total_count(0)
+{
+	this->partials.resize(partials);
+	for(unsigned int i = 0; i < partials; i++) {
+		// allocated on first use
+		this->partials[i].sum = nullptr;
+		this->partials[i].count = 0;
+		idle.push_back(i);
+	}
+
+	size_t size = (size_t) width * height * 3;
+	total = new uint64_t[size];
+	memset(total, 0, size * sizeof(uint64_t));
+}
+
+Stack::~Stack()
+{
+	for(Partial& partial : partials) {
+		if(partial.sum != nullptr) {
+			delete[] partial.sum;
+		}
+	}
+
+	delete[] total;
+}
+
+void Stack::add(const uint16_t* image, unsigned int stride)
+{
+	unsigned int index;
+
+	{
+		std::unique_lock<std::mutex> lock(partials_lock);
+		partials_cv.wait(lock, [this] { return !idle.empty(); });
+		index = idle.back();
+		idle.pop_back();
+	}
+
+	Partial& partial = partials[index];
+	size_t size = (size_t) width * height * 3;
+	if(partial.sum == nullptr) {
+		partial.sum = new uint32_t[size];
+		memset(partial.sum, 0, size * sizeof(uint32_t));
+	}
+
+	uint32_t* sum = partial.sum;
+	for(unsigned int y = 0; y < height; y++) {
+		const uint16_t* pixels = image + (size_t) y * stride * 4;
+		for(unsigned int x = 0; x < width; x++) {
+			sum[0] += pixels[0];
+			sum[1] += pixels[1];
+			sum[2] += pixels[2];
+			sum += 3;
+			pixels += 4;
+		}
+	}
+
+	if(++partial.count == PARTIAL_LIMIT) {
+		spill(partial);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(partials_lock);
+		idle.push_back(index);
+	}
+	partials_cv.notify_one();
+}
+
+void Stack::spill(Partial& partial)
+{
+	std::lock_guard<std::mutex> lock(total_lock);
+
+	size_t size = (size_t) width * height * 3;
+	for(size_t i = 0; i < size; i++) {
+		total[i] += partial.sum[i];
+	}
+	total_count += partial.count;
+
+	memset(partial.sum, 0, size * sizeof(uint32_t));
+	partial.count = 0;
+}
+
+unsigned long Stack::get_count()
+{
+	unsigned long count = total_count;
+	for(Partial& partial : partials) {
+		count += partial.count;
+	}
+	return count;
+}
+
+// Combines the total with all partial sums and divides by the frame count.
+// Every thread handles a slice of the frame, so the reduction runs at memory
+// bandwidth. Must only be called once all frames were added.
+void Stack::reduce(uint32_t* mean)
+{
+	unsigned long count = get_count();
+	if(count == 0) {
+		count = 1;
+	}
+
+	std::vector<uint32_t*> sums;
+	for(Partial& partial : partials) {
+		if(partial.sum != nullptr && partial.count) {
+			sums.push_back(partial.sum);
+		}
+	}
+
+	unsigned int threads = std::thread::hardware_concurrency();
+	if(threads == 0) {
+		threads = 1;
+	}
+
+	size_t size = (size_t) width * height * 3;
+	size_t slice = (size + threads - 1) / threads;
+
+	std::vector<std::thread> workers;
+	for(unsigned int t = 0; t < threads; t++) {
+		size_t start = t * slice;
+		size_t end = start + slice < size ? start + slice : size;
+		workers.push_back(std::thread([=, &sums] {
+			for(size_t i = start; i < end; i++) {
+				uint64_t sum = total[i];
+				for(uint32_t* partial : sums) {
+					sum += partial[i];
+				}
+				mean[i] = (uint32_t) (sum / count);
+			}
+		}));
+	}
+
+	for(std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+// Mean as accumulator contents for VideoProcessor::load_state with a single
+// sample, which renders exactly like the full sum of all frames.
+void Stack::mean(uint32_t* accumulator)
+{
+	reduce(accumulator);
+}
+
+// Mean in the format of VideoProcessor::output_raw.
+void Stack::mean_raw(uint16_t* image)
+{
+	size_t count = (size_t) width * height;
+	uint32_t* mean = new uint32_t[count * 3];
+	reduce(mean);
+
+	// the accumulator has no alpha channel, the shader reads 1 instead
+	uint16_t alpha = get_count() == 1 ? 1 : 0;
+	for(size_t i = 0; i < count; i++) {
+		image[i * 4 + 0] = mean[i * 3 + 0];
+		image[i * 4 + 1] = mean[i * 3 + 1];
+		image[i * 4 + 2] = mean[i * 3 + 2];
+		image[i * 4 + 3] = alpha;
+	}
+
+	delete[] mean;
+}
@@ -0,0 +1,187 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "stream.h"
+
+// frames which may wait for the consumer before push blocks
+#define	STREAM_QUEUE	4
+
+#define	Y4M_FRAME	"FRAME\n"
+
+StreamWriter::StreamWriter(int fd, StreamFormat format, unsigned int width,
+		unsigned int height, float fps)
+	: fd(fd), format(format), width(width), height(height), done(false),
+		failed(false)
+{
+	buffer = new uint8_t[frame_size()];
+
+#ifdef F_SETPIPE_SZ
+	// the default 64k pipe buffer means a context switch per 64k; ask for
+	// a whole frame (fails silently for files and above the system limit)
+	int size = frame_size();
+	FILE* f = fopen("/proc/sys/fs/pipe-max-size", "rt");
+	if(f) {
+		int max;
+		if(fscanf(f, "%d", &max) == 1 && size > max) {
+			size = max;
+		}
+		fclose(f);
+	}
+	fcntl(fd, F_SETPIPE_SZ, size);
+#endif
+
+	if(format == STREAM_Y4M) {
+		char header[128];
+		unsigned int rate = (unsigned int) lroundf(fps * 1000.0f);
+		snprintf(header, sizeof(header),
+				"YUV4MPEG2 W%u H%u F%u:1000 Ip A1:1 C444 "
+				"XCOLORRANGE=LIMITED\n", width, height, rate);
+		write_all(header, strlen(header));
+	}
+
+	thread = std::thread(&StreamWriter::run, this);
+}
+
+// Waits until all queued frames are written.
+StreamWriter::~StreamWriter()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+
+	thread.join();
+
+	delete[] buffer;
+}
+
+// Reserves the place of an output frame in the stream; reserved frames are
+// queued in this order.
+void StreamWriter::reserve(unsigned long index)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	order.push_back(index);
+}
+
+// Queues a frame, which returns to its pool once written. Returns false
+// once the consumer went away.
+bool StreamWriter::push(FrameBuffer image, unsigned long index)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [this, index] {
+		return queue.size() < STREAM_QUEUE &&
+			(order.empty() || order.front() == index);
+	});
+	queue.push_back(std::move(image));
+	if(!order.empty()) {
+		order.pop_front();
+	}
+	guard.unlock();
+	cv.notify_all();
+
+	return !failed;
+}
+
+void StreamWriter::run()
+{
+	while(true) {
+		FrameBuffer image;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cv.wait(guard, [this] {
+				return done || !queue.empty();
+			});
+			if(queue.empty()) {
+				return;
+			}
+			image = std::move(queue.front());
+			queue.pop_front();
+		}
+		cv.notify_all();
+
+		if(!failed) {
+			convert(image.get<void>());
+			if(format == STREAM_Y4M) {
+				failed = !write_all(Y4M_FRAME,
+						strlen(Y4M_FRAME));
+			}
+			if(!failed) {
+				failed = !write_all(buffer, frame_size());
+			}
+		}
+	}
+}
+
+size_t StreamWriter::frame_size()
+{
+	size_t pixels = (size_t) width * height;
+	switch(format) {
+		case STREAM_Y4M:
+			return pixels * 3;
+		case STREAM_BGRA:
+			return pixels * 4;
+		case STREAM_RGB48:
+		default:
+			return pixels * 3 * sizeof(uint16_t);
+	}
+}
+
+// Converts a frame into the stream format in buffer.
+void StreamWriter::convert(void* image)
+{
+	size_t pixels = (size_t) width * height;
+
+	if(format == STREAM_BGRA) {
+		memcpy(buffer, image, pixels * 4);
+	} else if(format == STREAM_RGB48) {
+		const uint16_t* src = (const uint16_t*) image;
+		uint16_t* dst = (uint16_t*) buffer;
+		for(size_t i = 0; i < pixels; i++) {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst += 3;
+			src += 4;
+		}
+	} else {
+		// planar BT.709 limited range
+		const uint8_t* src = (const uint8_t*) image;
+		uint8_t* y = buffer;
+		uint8_t* cb = buffer + pixels;
+		uint8_t* cr = buffer + pixels * 2;
+		for(size_t i = 0; i < pixels; i++) {
+			int b = src[0];
+			int g = src[1];
+			int r = src[2];
+			y[i] = ((47 * r + 157 * g + 16 * b + 128) >> 8) + 16;
+			cb[i] = ((-26 * r - 87 * g + 112 * b + 128) >> 8) + 128;
+			cr[i] = ((112 * r - 102 * g - 10 * b + 128) >> 8) + 128;
+			src += 4;
+		}
+	}
+}
+
+bool StreamWriter::write_all(const void* data, size_t size)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	while(size) {
+		ssize_t n = write(fd, p, size);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error writing the stream: %s\n",
+					strerror(errno));
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
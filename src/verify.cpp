@@ -0,0 +1,623 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "brawshot.h"
+#include "libbrawshot.h"
+#include "verify.h"
+
+// distinct synthetic frames; the clip repeats them
+#define	VERIFY_FRAMES	17
+
+// frames pushed after the window is full
+#define	VERIFY_OUTPUTS	32
+
+// the throughput checks push more frames, and only time them after a few
+// untimed ones have warmed up the driver
+#define	THROUGHPUT_OUTPUTS	160
+#define	THROUGHPUT_WARMUP	16
+
+#define	REF_NONE	0
+#define	REF_BEFORE_LUT	1
+#define	REF_AFTER_LUT	2
+
+#define	ROBUST_NONE	0
+#define	ROBUST_SIGMA	1
+#define	ROBUST_MEDIAN	2
+
+// pixels of padding after every row of the frames of the library check
+#define	LIBRARY_PADDING	13
+
+// kappa of the sigma clipping, and its rejection passes in robust.frag
+#define	VERIFY_KAPPA	2.5f
+#define	SIGMA_ITERATIONS	3
+
+struct VerifyCase {
+	const char*	name;
+	unsigned int	width;
+	unsigned int	height;
+	unsigned int	window;
+	unsigned int	tile_height;
+	int		ref;
+	bool		lut;
+	int		robust;
+	unsigned int	bits;
+	bool		throughput;
+};
+
+// odd sizes, so no row or band is a multiple of anything
+static const VerifyCase cases[] = {
+	{ "window-1",		67, 45, 1, 0, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "window-2",		67, 45, 2, 0, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "window-5",		67, 45, 5, 0, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "window-16",		67, 45, 16, 0, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "window-64",		67, 45, 64, 0, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "tiled",		67, 45, 9, 7, REF_NONE, false, ROBUST_NONE, 16, false },
+	{ "ref",		67, 45, 8, 0, REF_BEFORE_LUT, false, ROBUST_NONE, 16, false },
+	{ "lut",		67, 45, 8, 0, REF_NONE, true, ROBUST_NONE, 16, false },
+	{ "ref-lut",		67, 45, 8, 0, REF_BEFORE_LUT, true, ROBUST_NONE, 16, false },
+	{ "ref-after-lut",	67, 45, 8, 0, REF_AFTER_LUT, true, ROBUST_NONE, 16, false },
+	{ "tiled-ref-lut",	67, 45, 8, 10, REF_AFTER_LUT, true, ROBUST_NONE, 16, false },
+	{ "sigma",		67, 45, 8, 0, REF_NONE, false, ROBUST_SIGMA, 16, false },
+	{ "median",		67, 45, 7, 0, REF_NONE, false, ROBUST_MEDIAN, 16, false },
+	{ "tiled-median",	67, 45, 6, 11, REF_NONE, true, ROBUST_MEDIAN, 16, false },
+	{ "narrow-16",		67, 45, 16, 0, REF_NONE, false, ROBUST_NONE, 12, false },
+	{ "narrow-tiled-lut",	67, 45, 16, 10, REF_AFTER_LUT, true, ROBUST_NONE, 12, false },
+	{ "narrow-window-2",	67, 45, 2, 0, REF_BEFORE_LUT, false, ROBUST_NONE, 15, false },
+	{ "throughput",		960, 540, 16, 0, REF_NONE, false, ROBUST_NONE, 16, true },
+	{ "throughput-tiled",	960, 540, 16, 128, REF_NONE, false, ROBUST_NONE, 16, true },
+	{ "throughput-narrow",	960, 540, 16, 0, REF_NONE, false, ROBUST_NONE, 12, true }
+};
+
+static uint32_t next_random(uint32_t* state)
+{
+	*state = *state * 1664525u + 1013904223u;
+	return *state >> 8;
+}
+
+// Noise around a gradient, with some pixels close to full scale so the sums
+// get large, reduced to the given number of bits.
+static void make_frame(uint16_t* image, unsigned int width,
+		unsigned int height, unsigned int index, unsigned int bits)
+{
+	uint32_t state = 0x9e3779b9u * (index + 1);
+	for(unsigned int y = 0; y < height; y++) {
+		for(unsigned int x = 0; x < width; x++) {
+			uint16_t* p = &image[((size_t) y * width + x) * 4];
+			for(unsigned int c = 0; c < 3; c++) {
+				uint32_t value = (x * 977 + y * 331 + c * 8000) %
+					50000 + next_random(&state) % 4096;
+				if(next_random(&state) % 64 == 0) {
+					value = 65535 - next_random(&state) % 16;
+				}
+				p[c] = (value > 65535 ? 65535 : value) >>
+					(16 - bits);
+			}
+			p[3] = 65535 >> (16 - bits);
+		}
+	}
+}
+
+static bool write_lut(const char* filename)
+{
+	FILE* f = fopen(filename, "wt");
+	if(!f) {
+		return false;
+	}
+
+	const unsigned int points = 17;
+	fprintf(f, "LUT_3D_SIZE %u\n", points);
+	for(unsigned int b = 0; b < points; b++) {
+		for(unsigned int g = 0; g < points; g++) {
+			for(unsigned int r = 0; r < points; r++) {
+				fprintf(f, "%.6f %.6f %.6f\n",
+						pow(r / 16.0, 0.8),
+						pow(g / 16.0, 1.2),
+						0.25 + 0.5 * b / 16.0);
+			}
+		}
+	}
+	fclose(f);
+
+	return true;
+}
+
+// The 32bit accumulator is kept if wide is set, otherwise the processor
+// chooses the narrowest one for the window.
+static VideoProcessor* create_processor(const VerifyCase& test,
+		const char* lut_filename, uint16_t* ref, bool wide)
+{
+	VideoProcessor* processor = new VideoProcessor(test.width,
+			test.height, 1.7f, test.lut ? lut_filename : nullptr,
+			test.tile_height);
+	processor->set_deep_output(false);
+
+	if(test.ref != REF_NONE) {
+		processor->load_reference(ref, test.ref == REF_AFTER_LUT);
+	}
+
+	if(test.robust != ROBUST_NONE && !processor->set_robust(test.window,
+				test.robust == ROBUST_MEDIAN, VERIFY_KAPPA)) {
+		delete processor;
+		return nullptr;
+	}
+
+	if(!wide) {
+		processor->set_window(test.window, test.bits);
+	}
+
+	return processor;
+}
+
+// Returns the number of differing values and prints the first one. If
+// checked is given, only the values which are set in it are compared.
+template<typename T>
+static size_t compare(const char* name, const char* what, const T* image,
+		const T* expected, unsigned int width, unsigned int height,
+		unsigned long frame, bool alpha = true,
+		const uint8_t* checked = nullptr)
+{
+	size_t errors = 0;
+	for(size_t i = 0; i < (size_t) width * height * 4; i++) {
+		if((i % 4 == 3 && !alpha) || (checked != nullptr && !checked[i])) {
+			continue;
+		}
+		if(image[i] != expected[i]) {
+			if(errors == 0) {
+				size_t pixel = i / 4;
+				printf("%s: %s differs at frame %lu, pixel %zu,%zu channel %zu: %u != %u\n",
+						name, what, frame, pixel % width,
+						pixel / width, i % 4,
+						(unsigned int) image[i],
+						(unsigned int) expected[i]);
+			}
+			errors++;
+		}
+	}
+	return errors;
+}
+
+// The median of the n samples of value i, the lower one of the two middle
+// samples for an even n like robust.frag.
+static uint16_t median_of(const uint16_t* const* samples, unsigned int n,
+		size_t i)
+{
+	std::vector<uint16_t> values(n);
+	for(unsigned int k = 0; k < n; k++) {
+		values[k] = samples[k][i];
+	}
+	std::nth_element(values.begin(), values.begin() + (n - 1) / 2,
+			values.end());
+	return values[(n - 1) / 2];
+}
+
+// The kappa-sigma clipped mean of the n samples of value i as robust.frag
+// computes it, in doubles. The shader sums in floats, so a sample closer to
+// a clipping bound than the error of those sums may be kept or rejected
+// either way; returns false for such a value, which cannot be checked.
+static bool sigma_clip_of(const uint16_t* const* samples, unsigned int n,
+		size_t i, uint16_t* result)
+{
+	double base = samples[0][i];
+	double lower = 0.0;
+	double upper = 65535.0;
+	double margin = 0.0;
+	uint64_t value = samples[0][i];
+
+	for(int iteration = 0; iteration <= SIGMA_ITERATIONS; iteration++) {
+		double sum = 0.0;
+		double sum_sq = 0.0;
+		uint64_t isum = 0;
+		unsigned int icount = 0;
+
+		for(unsigned int k = 0; k < n; k++) {
+			double v = samples[k][i];
+			if(fabs(v - lower) < margin || fabs(v - upper) < margin) {
+				return false;
+			}
+			if(v >= lower && v <= upper) {
+				sum += v - base;
+				sum_sq += (v - base) * (v - base);
+				isum += samples[k][i];
+				icount++;
+			}
+		}
+
+		if(icount) {
+			value = isum / icount;
+		}
+
+		double used = icount ? icount : 1;
+		double mean = sum / used;
+		double sigma = sqrt(std::max(sum_sq / used - mean * mean, 0.0));
+
+		// bound of the float rounding of the variance, which can be
+		// most of it if the samples are close together
+		margin = VERIFY_KAPPA * sqrt(1e-6 * n * sum_sq / used) + 1.0;
+		lower = base + mean - VERIFY_KAPPA * sigma;
+		upper = base + mean + VERIFY_KAPPA * sigma;
+	}
+
+	*result = value;
+	return true;
+}
+
+// Runs the sliding window over the synthetic clip. Returns the frame rate of
+// the GPU work for the throughput checks, 0 for the others, or -1 if the
+// output is wrong.
+static float run_case(const VerifyCase& test, const char* lut_filename)
+{
+	unsigned int width = test.width;
+	unsigned int height = test.height;
+	size_t values = (size_t) width * height * 4;
+
+	std::vector<std::vector<uint16_t>> frames(VERIFY_FRAMES);
+	for(unsigned int i = 0; i < VERIFY_FRAMES; i++) {
+		frames[i].resize(values);
+		make_frame(frames[i].data(), width, height, i, test.bits);
+	}
+
+	std::vector<uint16_t> ref(values);
+	make_frame(ref.data(), width, height, VERIFY_FRAMES, test.bits);
+	for(uint16_t& value : ref) {
+		value /= 8;
+	}
+
+	VideoProcessor* processor = create_processor(test, lut_filename,
+			ref.data(), false);
+	if(processor == nullptr) {
+		return -1;
+	}
+
+	std::vector<uint64_t> sum(values, 0);
+	std::vector<uint16_t> raw(values);
+	std::vector<uint16_t> expected(values);
+	std::vector<uint8_t> checked(values);
+	std::vector<const uint16_t*> ring(test.window);
+
+	unsigned long count = test.window + (test.throughput ?
+			THROUGHPUT_OUTPUTS : VERIFY_OUTPUTS);
+	unsigned long warmup = test.window + THROUGHPUT_WARMUP;
+	size_t errors = 0;
+	std::chrono::duration<float> gpu(0);
+
+	for(unsigned long n = 0; n < count && errors == 0; n++) {
+		std::vector<uint16_t>& frame = frames[n % VERIFY_FRAMES];
+
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+
+		// the ring of the robust stack drops old frames by itself
+		if(n >= test.window && test.robust == ROBUST_NONE) {
+			processor->subtract(frames[(n - test.window) %
+					VERIFY_FRAMES].data());
+		}
+		processor->add(frame.data());
+
+		bool output = n + 1 >= test.window;
+		if(output) {
+			processor->output_raw(raw.data());
+		}
+
+		if(n >= warmup) {
+			gpu += std::chrono::steady_clock::now() - start;
+		}
+
+		for(size_t i = 0; i < values; i++) {
+			sum[i] += frame[i];
+			if(n >= test.window) {
+				sum[i] -= frames[(n - test.window) %
+					VERIFY_FRAMES][i];
+			}
+		}
+
+		if(!output) {
+			continue;
+		}
+
+		if(test.robust == ROBUST_NONE) {
+			for(size_t i = 0; i < values; i++) {
+				expected[i] = sum[i] / test.window;
+			}
+
+			// the accumulator has no alpha channel
+			errors += compare(test.name, "RAW output", raw.data(),
+					expected.data(), width, height, n,
+					false);
+		} else {
+			// layer l of the ring holds the frame of the window whose
+			// index is l modulo the window
+			for(unsigned int l = 0; l < test.window; l++) {
+				unsigned long i = n - (n % test.window + test.window -
+						l) % test.window;
+				ring[l] = frames[i % VERIFY_FRAMES].data();
+			}
+
+			size_t unchecked = 0;
+			for(size_t i = 0; i < values; i++) {
+				checked[i] = 1;
+				if(i % 4 == 3) {
+					continue;
+				} else if(test.robust == ROBUST_MEDIAN) {
+					expected[i] = median_of(ring.data(),
+							test.window, i);
+				} else if(!sigma_clip_of(ring.data(), test.window,
+							i, &expected[i])) {
+					checked[i] = 0;
+					unchecked++;
+				}
+			}
+
+			// a reference which can hardly check anything is no
+			// reference at all
+			if(unchecked > values / 100) {
+				printf("%s: %zu values at frame %lu are too close to the clipping bounds\n",
+						test.name, unchecked, n);
+				errors++;
+			}
+
+			errors += compare(test.name, "RAW output", raw.data(),
+					expected.data(), width, height, n,
+					false, checked.data());
+		}
+
+		// a new processor which only sees the frames of the window
+		// has to render exactly the same frame, also with the 32bit
+		// accumulator if the processor chose a narrower one
+		bool last = n + 1 == count;
+		if(n + 1 == test.window || n == count / 2 || last) {
+			VideoProcessor* fresh = create_processor(test,
+					lut_filename, ref.data(), true);
+			for(unsigned long i = n + 1 - test.window; i <= n; i++) {
+				fresh->add(frames[i % VERIFY_FRAMES].data());
+			}
+
+			std::vector<uint16_t> fresh_raw(values);
+			fresh->output_raw(fresh_raw.data());
+			errors += compare(test.name, "RAW output of a fresh window",
+					raw.data(), fresh_raw.data(), width,
+					height, n);
+
+			std::vector<uint8_t> graded(values);
+			std::vector<uint8_t> fresh_graded(values);
+			processor->output(graded.data());
+			fresh->output(fresh_graded.data());
+			errors += compare(test.name, "graded output",
+					graded.data(), fresh_graded.data(),
+					width, height, n);
+
+			std::vector<uint16_t> deep(values);
+			std::vector<uint16_t> fresh_deep(values);
+			processor->output_deep(deep.data(), false);
+			fresh->output_deep(fresh_deep.data(), false);
+			errors += compare(test.name, "16bit output",
+					deep.data(), fresh_deep.data(),
+					width, height, n);
+
+			delete fresh;
+		}
+	}
+
+	delete processor;
+
+	if(errors) {
+		return -1;
+	}
+
+	if(!test.throughput) {
+		return 0;
+	}
+
+	return (count - warmup) / gpu.count();
+}
+
+// Pushes the synthetic clip through libbrawshot as rows of a wider frame,
+// with a reference frame of the same stride and garbage in the padding. The
+// graded output has to match a processor which gets the packed frames.
+static bool run_library_case(const char* lut_filename)
+{
+	static const VerifyCase test = { "library-stride", 67, 45, 5, 0,
+		REF_BEFORE_LUT, true, ROBUST_NONE, 16, false };
+	unsigned int width = test.width;
+	unsigned int height = test.height;
+	unsigned int stride = width + LIBRARY_PADDING;
+	size_t values = (size_t) width * height * 4;
+
+	// the packed frames, and the same frames in the rows of a wider one
+	std::vector<std::vector<uint16_t>> frames(VERIFY_FRAMES + 1);
+	std::vector<std::vector<uint16_t>> wide(VERIFY_FRAMES + 1);
+	for(unsigned int i = 0; i <= VERIFY_FRAMES; i++) {
+		frames[i].resize(values);
+		make_frame(frames[i].data(), width, height, i, test.bits);
+		if(i == VERIFY_FRAMES) {
+			for(uint16_t& value : frames[i]) {
+				value /= 8;
+			}
+		}
+
+		wide[i].assign((size_t) stride * height * 4, 65535);
+		for(unsigned int y = 0; y < height; y++) {
+			memcpy(&wide[i][(size_t) y * stride * 4],
+					&frames[i][(size_t) y * width * 4],
+					width * 4 * sizeof(uint16_t));
+		}
+	}
+
+	brawshot_config_t config;
+	memset(&config, 0, sizeof(config));
+	config.width = width;
+	config.height = height;
+	config.stride = stride;
+	config.window = test.window;
+	config.gain = 1.7f;
+	config.lut_filename = lut_filename;
+	config.output = BRAWSHOT_OUTPUT_BGRA8;
+	config.input_bits = test.bits;
+
+	brawshot_t* filter = brawshot_create(&config, nullptr, nullptr,
+			nullptr);
+	VideoProcessor* processor = create_processor(test, lut_filename,
+			frames[VERIFY_FRAMES].data(), false);
+	if(filter == nullptr || processor == nullptr) {
+		brawshot_destroy(filter);
+		delete processor;
+		return false;
+	}
+	brawshot_load_reference(filter, wide[VERIFY_FRAMES].data(),
+			test.ref == REF_AFTER_LUT);
+
+	std::vector<uint8_t> image(brawshot_frame_size(filter));
+	std::vector<uint8_t> expected(values);
+
+	size_t errors = 0;
+	for(unsigned long n = 0; n < test.window + VERIFY_OUTPUTS &&
+			errors == 0; n++) {
+		if(n >= test.window) {
+			processor->subtract(frames[(n - test.window) %
+					VERIFY_FRAMES].data());
+		}
+		processor->add(frames[n % VERIFY_FRAMES].data());
+
+		bool output = brawshot_push(filter,
+				wide[n % VERIFY_FRAMES].data(), nullptr,
+				image.data()) != 0;
+		if(output != (n + 1 >= test.window)) {
+			printf("%s: unexpected output at frame %lu\n",
+					test.name, n);
+			errors++;
+		}
+		if(!output) {
+			continue;
+		}
+
+		processor->output(expected.data());
+		errors += compare(test.name, "graded output", image.data(),
+				expected.data(), width, height, n);
+	}
+
+	brawshot_destroy(filter);
+	delete processor;
+
+	return errors == 0;
+}
+
+static std::map<std::string, float> read_baseline(const char* filename)
+{
+	std::map<std::string, float> baseline;
+
+	FILE* f = fopen(filename, "rt");
+	if(!f) {
+		return baseline;
+	}
+
+	char name[256];
+	float fps;
+	while(fscanf(f, "%255s %f", name, &fps) == 2) {
+		baseline[name] = fps;
+	}
+	fclose(f);
+
+	return baseline;
+}
+
+static bool write_baseline(const char* filename,
+		const std::map<std::string, float>& baseline)
+{
+	std::string tmpname = std::string(filename) + ".part";
+	FILE* f = fopen(tmpname.c_str(), "wt");
+	if(!f) {
+		printf("Error creating %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+		return false;
+	}
+	for(auto& entry : baseline) {
+		fprintf(f, "%s %.1f\n", entry.first.c_str(), entry.second);
+	}
+	fclose(f);
+
+	if(rename(tmpname.c_str(), filename) != 0) {
+		printf("Error renaming %s: %s\n", tmpname.c_str(),
+				strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+bool run_verify(const char* baseline_filename, float threshold)
+{
+	char lut_filename[] = "/tmp/brawshot-verify-XXXXXX";
+	int fd = mkstemp(lut_filename);
+	if(fd < 0 || !write_lut(lut_filename)) {
+		printf("Error creating the test LUT: %s\n", strerror(errno));
+		return false;
+	}
+	close(fd);
+
+	std::map<std::string, float> baseline;
+	if(baseline_filename != nullptr) {
+		baseline = read_baseline(baseline_filename);
+	}
+
+	unsigned int failed = 0;
+	bool update = false;
+	for(const VerifyCase& test : cases) {
+		float fps = run_case(test, lut_filename);
+		if(fps < 0) {
+			printf("%-18s FAILED\n", test.name);
+			failed++;
+			continue;
+		}
+
+		// the small checks are over too quickly to be timed reliably
+		auto it = baseline.find(test.name);
+		if(!test.throughput) {
+			printf("%-18s ok\n", test.name);
+		} else if(baseline_filename == nullptr) {
+			printf("%-18s ok %10.1f fps\n", test.name, fps);
+		} else if(it == baseline.end()) {
+			printf("%-18s ok %10.1f fps (new baseline)\n",
+					test.name, fps);
+			baseline[test.name] = fps;
+			update = true;
+		} else if(fps < it->second * (1 - threshold / 100)) {
+			printf("%-18s SLOWER %10.1f fps (baseline %.1f)\n",
+					test.name, fps, it->second);
+			failed++;
+		} else {
+			printf("%-18s ok %10.1f fps (baseline %.1f)\n",
+					test.name, fps, it->second);
+		}
+	}
+
+	// the C API, which the checks above bypass
+	if(run_library_case(lut_filename)) {
+		printf("%-18s ok\n", "library-stride");
+	} else {
+		printf("%-18s FAILED\n", "library-stride");
+		failed++;
+	}
+
+	unlink(lut_filename);
+
+	if(update && !write_baseline(baseline_filename, baseline)) {
+		return false;
+	}
+
+	size_t checks = sizeof(cases) / sizeof(*cases) + 1;
+	if(failed) {
+		printf("%u of %zu checks failed\n", failed, checks);
+		return false;
+	}
+
+	printf("All %zu checks passed\n", checks);
+	return true;
+}
@@ -0,0 +1,38 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "verify.h"
+
+// The self check of brawshot --verify as a tool of its own, which only needs
+// the static library and not the BRAW SDK.
+int main(int argc, const char** argv)
+{
+	const char* self = argv[0];
+	const char* baseline = nullptr;
+	float threshold = 20.0f;
+
+	argc--;
+	argv++;
+	for(; argc; argc--, argv++) {
+		if(!strcmp(*argv, "--baseline") && argc > 1) {
+			baseline = argv[1];
+			argc--;
+			argv++;
+		} else if(!strcmp(*argv, "--threshold") && argc > 1) {
+			threshold = (float) atof(argv[1]);
+			if(threshold <= 0 || threshold >= 100) {
+				fprintf(stderr, "Invalid threshold\n");
+				return 1;
+			}
+			argc--;
+			argv++;
+		} else {
+			fprintf(stderr, "Usage: %s [--baseline verify.txt] [--threshold 20]\n",
+					self);
+			return 1;
+		}
+	}
+
+	return run_verify(baseline, threshold) ? 0 : 1;
+}
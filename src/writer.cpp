@@ -0,0 +1,481 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "writer.h"
+
+// files which may be queued or in flight before write blocks
+#define	WRITER_QUEUE	16
+
+#define	URING_ENTRIES	64
+
+// largest single write; O_DIRECT needs multiples of DIRECT_ALIGN
+#define	WRITE_CHUNK	(1UL << 30)
+#define	DIRECT_ALIGN	4096
+
+static std::string directory(const std::string& filename)
+{
+	size_t slash = filename.rfind('/');
+	return slash == std::string::npos ? "." :
+		filename.substr(0, slash + 1);
+}
+
+FileWriter::FileWriter(bool use_uring, unsigned int count, FsyncPolicy fsync,
+		bool direct, Metrics* metrics)
+	: fsync_policy(fsync), direct(direct), metrics(metrics), busy(0),
+		done(false),
+		ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr)
+{
+	if(use_uring && setup_uring()) {
+		threads.push_back(std::thread(&FileWriter::run_uring, this));
+	} else {
+		for(unsigned int i = 0; i < count; i++) {
+			threads.push_back(std::thread(&FileWriter::run_threads,
+						this));
+		}
+	}
+}
+
+FileWriter::~FileWriter()
+{
+	wait();
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	cv.notify_all();
+
+	for(std::thread& thread : threads) {
+		thread.join();
+	}
+
+	if(ring_fd >= 0) {
+		munmap(sqes, sqes_size);
+		if(cq_ring != sq_ring) {
+			munmap(cq_ring, cq_ring_size);
+		}
+		munmap(sq_ring, sq_ring_size);
+		close(ring_fd);
+	}
+}
+
+// Maps the rings of a new io_uring instance. Fails on kernels without
+// io_uring (or without IORING_OP_WRITE, which came with the same release as
+// IORING_FEAT_RW_CUR_POS) and when it is blocked by a seccomp filter.
+bool FileWriter::setup_uring()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if(fd < 0) {
+		return false;
+	}
+
+	if(!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		return false;
+	}
+
+	sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single) {
+		if(cq_ring_size > sq_ring_size) {
+			sq_ring_size = cq_ring_size;
+		}
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sq_ring == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	if(single) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd,
+				IORING_OFF_CQ_RING);
+		if(cq_ring == MAP_FAILED) {
+			munmap(sq_ring, sq_ring_size);
+			close(fd);
+			return false;
+		}
+	}
+
+	sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) {
+		if(!single) {
+			munmap(cq_ring, cq_ring_size);
+		}
+		munmap(sq_ring, sq_ring_size);
+		close(fd);
+		return false;
+	}
+
+	uint8_t* sq = (uint8_t*) sq_ring;
+	uint8_t* cq = (uint8_t*) cq_ring;
+	sq_entries = params.sq_entries;
+	sq_head = (unsigned int*) (sq + params.sq_off.head);
+	sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+	sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+	sq_array = (unsigned int*) (sq + params.sq_off.array);
+	cq_head = (unsigned int*) (cq + params.cq_off.head);
+	cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+	cq_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+
+	ring_fd = fd;
+	return true;
+}
+
+void FileWriter::write(const char* filename, const void* data, size_t size,
+		const std::function<void()>& release)
+{
+	Job* job = new Job();
+	job->filename = filename;
+	job->tmpname = job->filename + ".part";
+	job->data = data;
+	job->size = size;
+	job->written = 0;
+	job->length = size;
+	job->release = release;
+	job->aligned = nullptr;
+	job->fd = -1;
+	job->pending = 0;
+
+	if(direct) {
+		// O_DIRECT writes whole blocks from aligned memory; the file
+		// is truncated to its real size afterwards
+		job->length = (size + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+		if((uintptr_t) data % DIRECT_ALIGN || job->length != size) {
+			if(posix_memalign(&job->aligned, DIRECT_ALIGN,
+						job->length) != 0) {
+				printf("Out of memory\n");
+				exit(1);
+			}
+			memcpy(job->aligned, data, size);
+			memset((uint8_t*) job->aligned + size, 0,
+					job->length - size);
+			job->data = job->aligned;
+			release();
+			job->release = nullptr;
+		}
+	}
+
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [this] {
+		return queue.size() + busy < WRITER_QUEUE;
+	});
+	queue.push_back(job);
+	cv.notify_all();
+}
+
+// Returns the number of files which are queued or being written.
+unsigned int FileWriter::get_pending()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return queue.size() + busy;
+}
+
+// Waits until all files are written and applies the fsync policy to them.
+void FileWriter::wait()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	cv.wait(guard, [this] {
+		return queue.empty() && busy == 0;
+	});
+
+	if(sync_dir.empty()) {
+		return;
+	}
+
+	sync_directory(sync_dir);
+	sync_dir.clear();
+}
+
+// The caller has to make sure that the files of filename are written.
+void FileWriter::sync(const std::string& filename)
+{
+	sync_directory(directory(filename));
+}
+
+void FileWriter::sync_directory(const std::string& dir)
+{
+	if(fsync_policy == FSYNC_NONE) {
+		return;
+	}
+
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if(fd >= 0) {
+		if(fsync_policy == FSYNC_END) {
+			syncfs(fd);
+		} else {
+			// makes the renames durable
+			fsync(fd);
+		}
+		close(fd);
+	}
+}
+
+void FileWriter::open_job(Job* job)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	job->fd = open(job->tmpname.c_str(), flags | (direct ? O_DIRECT : 0),
+			0644);
+	if(job->fd < 0 && direct && errno == EINVAL) {
+		// the file system does not support O_DIRECT
+		job->fd = open(job->tmpname.c_str(), flags, 0644);
+	}
+
+	if(job->fd < 0) {
+		printf("Error creating %s: %s\n", job->tmpname.c_str(),
+				strerror(errno));
+		exit(1);
+	}
+
+	if(job->length > 0) {
+		// ignored where the file system cannot preallocate
+		fallocate(job->fd, 0, 0, job->length);
+	}
+}
+
+void FileWriter::write_rest(Job* job)
+{
+	while(job->written < job->length) {
+		size_t length = job->length - job->written;
+		if(length > WRITE_CHUNK) {
+			length = WRITE_CHUNK;
+		}
+
+		ssize_t n = pwrite(job->fd, (const uint8_t*) job->data +
+				job->written, length, job->written);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n <= 0) {
+			printf("Error writing %s: %s\n", job->tmpname.c_str(),
+					strerror(n < 0 ? errno : ENOSPC));
+			exit(1);
+		}
+
+		job->written += n;
+	}
+
+	if(job->length != job->size && ftruncate(job->fd, job->size) != 0) {
+		printf("Error writing %s: %s\n", job->tmpname.c_str(),
+				strerror(errno));
+		exit(1);
+	}
+}
+
+// Closes and renames the file once it is written (and synced).
+void FileWriter::finish_job(Job* job)
+{
+	close(job->fd);
+
+	if(rename(job->tmpname.c_str(), job->filename.c_str()) != 0) {
+		printf("Error renaming %s: %s\n", job->tmpname.c_str(),
+				strerror(errno));
+		exit(1);
+	}
+
+	if(job->release) {
+		job->release();
+	}
+	free(job->aligned);
+
+	if(metrics != nullptr) {
+		Metrics::add(metrics->written);
+		Metrics::add(metrics->bytes_written, job->size);
+	}
+
+	std::string dir = directory(job->filename);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		sync_dir = dir;
+		busy--;
+	}
+	cv.notify_all();
+
+	delete job;
+}
+
+void FileWriter::run_threads()
+{
+	std::unique_lock<std::mutex> guard(lock);
+
+	while(true) {
+		cv.wait(guard, [this] {
+			return done || !queue.empty();
+		});
+		if(queue.empty()) {
+			break;
+		}
+
+		Job* job = queue.front();
+		queue.pop_front();
+		busy++;
+
+		guard.unlock();
+		open_job(job);
+		write_rest(job);
+		if(fsync_policy == FSYNC_FILE) {
+			fdatasync(job->fd);
+		}
+		finish_job(job);
+		guard.lock();
+	}
+}
+
+// A single thread opens the files, submits all writes (and fsyncs) of the
+// queued files with one io_uring_enter and finishes the files whose
+// operations completed. Every file has at most one operation in flight.
+void FileWriter::run_uring()
+{
+	unsigned int inflight = 0;
+	unsigned int to_submit = 0;
+
+	auto prepare = [&](Job* job, bool sync) {
+		unsigned int tail = *sq_tail;
+		unsigned int index = tail & *sq_mask;
+		struct io_uring_sqe* sqe = (struct io_uring_sqe*) sqes + index;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = job->fd;
+		sqe->user_data = (uint64_t) (uintptr_t) job;
+		if(sync) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		} else {
+			size_t length = job->length - job->written;
+			if(length > WRITE_CHUNK) {
+				length = WRITE_CHUNK;
+			}
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->addr = (uint64_t) (uintptr_t) ((const uint8_t*)
+					job->data + job->written);
+			sqe->len = length;
+			sqe->off = job->written;
+		}
+
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		job->pending = 1;
+		inflight++;
+		to_submit++;
+	};
+
+	// the next step of a file after its last operation
+	auto advance = [&](Job* job) {
+		if(job->written < job->length) {
+			prepare(job, false);
+		} else if(fsync_policy == FSYNC_FILE && job->pending != 2) {
+			if(job->length != job->size) {
+				write_rest(job);
+			}
+			prepare(job, true);
+			job->pending = 2;
+		} else {
+			if(job->length != job->size &&
+					fsync_policy != FSYNC_FILE) {
+				write_rest(job);
+			}
+			finish_job(job);
+		}
+	};
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	while(true) {
+		if(inflight == 0) {
+			cv.wait(guard, [this] {
+				return done || !queue.empty();
+			});
+			if(queue.empty()) {
+				break;
+			}
+		}
+
+		std::vector<Job*> jobs;
+		while(!queue.empty() && inflight + jobs.size() < sq_entries) {
+			jobs.push_back(queue.front());
+			queue.pop_front();
+			busy++;
+		}
+
+		guard.unlock();
+
+		for(Job* job : jobs) {
+			open_job(job);
+			advance(job);
+		}
+
+		if(inflight > 0) {
+			int result = syscall(__NR_io_uring_enter, ring_fd,
+					to_submit, 1, IORING_ENTER_GETEVENTS,
+					nullptr, 0);
+			if(result < 0 && errno != EINTR) {
+				printf("io_uring_enter failed: %s\n",
+						strerror(errno));
+				exit(1);
+			} else if(result >= 0) {
+				to_submit -= result;
+			}
+		}
+
+		unsigned int head = *cq_head;
+		unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		std::vector<Job*> completed;
+		for(; head != tail; head++) {
+			struct io_uring_cqe* cqe = (struct io_uring_cqe*) cqes +
+				(head & *cq_mask);
+			Job* job = (Job*) (uintptr_t) cqe->user_data;
+
+			if(cqe->res < 0) {
+				printf("Error writing %s: %s\n",
+						job->tmpname.c_str(),
+						strerror(-cqe->res));
+				exit(1);
+			} else if(job->pending == 1 && cqe->res == 0) {
+				printf("Error writing %s: %s\n",
+						job->tmpname.c_str(),
+						strerror(ENOSPC));
+				exit(1);
+			}
+
+			if(job->pending == 1) {
+				job->written += cqe->res;
+				job->pending = 0;
+			}
+			inflight--;
+			completed.push_back(job);
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		for(Job* job : completed) {
+			advance(job);
+		}
+
+		guard.lock();
+	}
+}